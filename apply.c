@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+// Replays a stream from nufs-delta onto an unmounted copy of the image
+// taken at the generation the stream starts from. A full stream makes a
+// new copy of the same size.
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s image stream\n", prog);
+    fprintf(stderr, "  stream  file to read, - for stdin\n");
+    exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        usage(argv[0]);
+    }
+
+    const char* image = argv[1];
+    const char* stream = argv[2];
+    int fd = strcmp(stream, "-") == 0 ? 0 : open(stream, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(stream);
+        return 1;
+    }
+
+    // A copy made here has to be the size of the image the stream is from
+    long size = changes_image_size(fd);
+    if (size < 0)
+    {
+        fprintf(stderr, "%s: %s\n", stream, strerror(-size));
+        return 1;
+    }
+
+    storage_size(size);
+    storage_init(image, 0);
+    int generation = storage_generation();
+
+    // The image is rewritten underneath storage, so it isn't flushed after
+    int applied = apply_changes(fd);
+    if (applied == -ESTALE)
+    {
+        fprintf(stderr, "%s: image is at generation %d, stream is for another\n",
+                image, generation);
+        return 1;
+    }
+    if (applied < 0)
+    {
+        fprintf(stderr, "%s: %s\n", stream, strerror(-applied));
+        return 1;
+    }
+
+    printf("%d blocks applied, now at generation %d\n", applied, storage_generation());
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "nufs.h"
+
+// Copies a file inside a mounted nufs by sharing its blocks
+
+// Find the directory a mount is rooted at, the topmost one still on the
+// same device as path
+static void
+find_mount_root(const char* path, dev_t dev, char* root)
+{
+    strcpy(root, path);
+
+    while (strcmp(root, "/") != 0)
+    {
+        char buf[PATH_MAX];
+        strcpy(buf, root);
+        char* parent = dirname(buf);
+
+        struct stat st;
+        if (stat(parent, &st) != 0 || st.st_dev != dev)
+        {
+            return;
+        }
+        memmove(root, parent, strlen(parent) + 1);
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s src dst\n", argv[0]);
+        return 1;
+    }
+
+    struct stat src_st;
+    char src[PATH_MAX];
+    if (!realpath(argv[1], src) || stat(src, &src_st) != 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, src_st.st_mode & 0777);
+    if (fd == -1)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+
+    struct stat dst_st;
+    fstat(fd, &dst_st);
+    if (dst_st.st_dev != src_st.st_dev)
+    {
+        fprintf(stderr, "%s: %s and %s are not on the same mount\n",
+                argv[0], argv[1], argv[2]);
+        return 1;
+    }
+
+    // Daemon sees paths relative to the mount root
+    char root[PATH_MAX];
+    find_mount_root(src, src_st.st_dev, root);
+
+    nufs_clone_args args;
+    memset(&args, 0, sizeof(args));
+    const char* rel = strcmp(root, "/") == 0 ? src : src + strlen(root);
+    snprintf(args.src, sizeof(args.src), "%s", rel);
+
+    if (ioctl(fd, NUFS_IOC_CLONE, &args) != 0)
+    {
+        perror(argv[0]);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+
+// CRC-32C (Castagnoli), using the SSE4.2 crc32 instruction when the CPU
+// has it and a slicing-by-8 table otherwise. Pass 0 to start a new CRC.
+
+unsigned int crc32c(unsigned int crc, const void* data, size_t len);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+// Rewrites fragmented files of an unmounted image into contiguous runs
+
+static int dry_run = 0;
+static int threshold = 0;
+
+static int files = 0;
+static int moved = 0;
+static int skipped = 0;
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-n] [-t score] image [path...]\n", prog);
+    fprintf(stderr, "  -n        only report fragmented files\n");
+    fprintf(stderr, "  -t score  skip files scoring below this (0-100)\n");
+    fprintf(stderr, "  path      files to look at, each one reported (default: all)\n");
+    exit(1);
+}
+
+// Report given file and rewrite it if it is fragmented enough, files
+// asked for by name get reported even when left alone
+static void
+defrag_file(const char* name, inode* node, int named)
+{
+    files++;
+
+    int extents = inode_extents(node);
+    int score = fragmentation_score(node);
+    if (extents <= 1 || score < threshold)
+    {
+        if (named)
+        {
+            printf("%s: %d blocks in %d extents, score %d\n",
+                   name, node->blocks, extents, score);
+        }
+        return;
+    }
+
+    printf("%s: %d blocks in %d extents, score %d",
+           name, node->blocks, extents, score);
+
+    if (dry_run)
+    {
+        printf("\n");
+        return;
+    }
+
+    int rv = defrag_inode(node);
+    if (rv == 0)
+    {
+        printf(", now contiguous\n");
+        moved++;
+    }
+    else if (rv == -EBUSY)
+    {
+        printf(", shares blocks with other files\n");
+        skipped++;
+    }
+    else
+    {
+        printf(", no free run big enough\n");
+        skipped++;
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "nt:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 't':
+            threshold = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+    }
+
+    // Don't create an image that isn't there
+    const char* path = argv[optind];
+    if (access(path, R_OK | W_OK) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    storage_init(path, 0);
+
+    // Files named on the command line, or else every file
+    for (int i = optind + 1; i < argc; i++)
+    {
+        inode* node = get_inode(argv[i]);
+        if (!node || node->isdir)
+        {
+            fprintf(stderr, "%s: not a file in the image\n", argv[i]);
+            continue;
+        }
+        defrag_file(argv[i], node, 1);
+        storage_release();
+    }
+
+    for (int i = next_inode(0); optind == argc - 1 && i != -1; i = next_inode(i + 1))
+    {
+        inode* node = get_inode_num(i);
+        if (node->isdir)
+        {
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "inode %d", i);
+        defrag_file(name, node, 0);
+        storage_release();
+    }
+
+    // Leave checksums of moved blocks up to date
+    storage_flush();
+
+    printf("%d files, %d defragmented, %d skipped\n", files, moved, skipped);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+// Writes the blocks of an unmounted image changed since its last
+// checkpoint, or all of them, as a stream for nufs-apply
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-g generation] image stream\n", prog);
+    fprintf(stderr, "  -g generation  checkpoint to send changes since, 0 for everything\n");
+    fprintf(stderr, "                 (default: the last checkpoint)\n");
+    fprintf(stderr, "  stream         file to write, - for stdout\n");
+    exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int since = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "g:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'g':
+            since = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+    }
+
+    // Don't create an image that isn't there
+    const char* image = argv[optind];
+    if (access(image, R_OK | W_OK) != 0)
+    {
+        perror(image);
+        return 1;
+    }
+
+    storage_init(image, 0);
+    if (since == -1)
+    {
+        since = storage_generation();
+    }
+
+    if (since != 0 && since != storage_generation())
+    {
+        fprintf(stderr, "%s: changes are tracked since generation %d only\n",
+                image, storage_generation());
+        return 1;
+    }
+
+    const char* stream = argv[optind + 1];
+    int fd = strcmp(stream, "-") == 0 ? 1 : open(stream, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(stream);
+        return 1;
+    }
+
+    int sent = write_changes(fd, since);
+    if (sent < 0 || (fd != 1 && close(fd) != 0))
+    {
+        fprintf(stderr, "%s: %s\n", stream, strerror(sent < 0 ? -sent : errno));
+        return 1;
+    }
+
+    // Keeps the new checkpoint
+    storage_flush();
+
+    fprintf(stderr, "%d blocks changed since generation %d, now at %d\n",
+            sent, since, storage_generation());
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+#include "map.h"
+
+// Copies a directory tree of an unmounted image, or of one of its
+// snapshots, out to the host
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s image hostdir [dir]\n", prog);
+    fprintf(stderr, "  dir  directory of the image to copy out (default: /)\n");
+    exit(1);
+}
+
+// Write a file of the image to a new host file
+static int
+export_file(inode* node, const char* host)
+{
+    char* data = malloc(node->size ? node->size : 1);
+    int got = read_data(node, data, node->size, 0);
+    if (got < 0)
+    {
+        free(data);
+        return got;
+    }
+
+    int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, node->mode & 07777);
+    if (fd < 0)
+    {
+        free(data);
+        return -errno;
+    }
+
+    int done = 0;
+    while (done < got)
+    {
+        ssize_t put = write(fd, data + done, got - done);
+        if (put < 0)
+        {
+            int err = errno;
+            close(fd);
+            free(data);
+            return -err;
+        }
+        done += put;
+    }
+    free(data);
+
+    struct timespec times[2];
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec  = node->mtime;
+    times[1].tv_nsec = node->mtime_nsec;
+    futimens(fd, times);
+
+    close(fd);
+    return 0;
+}
+
+// Copy directory dir of the image to host, counting files and bytes
+static int
+export_tree(inode* dir, const char* host, int* files, long* bytes)
+{
+    if (mkdir(host, dir->mode & 07777) != 0 && errno != EEXIST)
+    {
+        perror(host);
+        return 1;
+    }
+
+    // The directory stays pinned, what each entry needed is let go after it
+    int errors = 0;
+    map* dirmap = get_block_num(dir->block);
+    int mark = storage_pins();
+    for (int i = 0; i < dirmap->size; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/%s", host, map_name(dirmap, i));
+
+        inode* node = get_entry_inode(dir, map_inode(dirmap, i));
+        if (!node)
+        {
+            fprintf(stderr, "%s: missing inode\n", path);
+            errors++;
+        }
+        else if (node->isdir)
+        {
+            errors += export_tree(node, path, files, bytes);
+        }
+        else
+        {
+            int rv = export_file(node, path);
+            if (rv != 0)
+            {
+                fprintf(stderr, "%s: %s\n", path, strerror(-rv));
+                errors++;
+            }
+            else
+            {
+                (*files)++;
+                *bytes += node->size;
+            }
+        }
+        storage_unpin(mark);
+    }
+
+    return errors;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3 || argc > 4)
+    {
+        usage(argv[0]);
+    }
+
+    // Don't create an image that isn't there
+    const char* image = argv[1];
+    if (access(image, R_OK | W_OK) != 0)
+    {
+        perror(image);
+        return 1;
+    }
+
+    const char* host = argv[2];
+    const char* src = argc == 4 ? argv[3] : "/";
+
+    storage_init(image, 0);
+
+    inode* dir = get_inode(src);
+    if (!dir || !dir->isdir || dir->block < 0)
+    {
+        fprintf(stderr, "%s: not a directory of the image\n", src);
+        return 1;
+    }
+
+    int files = 0;
+    long bytes = 0;
+    int errors = export_tree(dir, host, &files, &bytes);
+
+    printf("%d files, %ld bytes exported, %d errors\n", files, bytes, errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "storage.h"
+
+// Checks an unmounted image, verifying block checksums on several threads
+// while the main thread checks bitmaps, references and directories
+
+typedef struct checksum_job {
+    int first;
+    int last;
+    int bad;
+} checksum_job;
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-j threads] image\n", prog);
+    fprintf(stderr, "  -j threads  checksum threads (default: one per CPU)\n");
+    exit(1);
+}
+
+// Verify checksums of blocks in [first, last)
+static void*
+check_checksums(void* arg)
+{
+    checksum_job* job = arg;
+    for (int i = job->first; i < job->last; i++)
+    {
+        if (check_block(i) != 0)
+        {
+            printf("block %d: checksum mismatch\n", i);
+            job->bad++;
+        }
+        storage_release();
+    }
+    return NULL;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || threads < 1)
+    {
+        usage(argv[0]);
+    }
+
+    // The image is only read, checksums left stale by a crash are
+    // rebuilt by the next mount rather than here
+    const char* path = argv[optind];
+    storage_init(path, STORAGE_READONLY);
+    if (!storage_clean())
+    {
+        printf("image was not unmounted cleanly, checksums not checked\n");
+        threads = 0;
+    }
+
+    // Split blocks evenly, checked while the structure is walked
+    int count = get_block_count();
+    if (threads > count)
+    {
+        threads = count;
+    }
+
+    pthread_t* ids = calloc(threads, sizeof(pthread_t));
+    checksum_job* jobs = calloc(threads, sizeof(checksum_job));
+    for (int t = 0; t < threads; t++)
+    {
+        jobs[t].first = (long)count * t / threads;
+        jobs[t].last  = (long)count * (t + 1) / threads;
+        pthread_create(&ids[t], NULL, check_checksums, &jobs[t]);
+    }
+
+    int problems = check_storage();
+
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+        problems += jobs[t].bad;
+    }
+
+    free(ids);
+    free(jobs);
+
+    printf("%d blocks checked, %d problems\n", count, problems);
+    return problems ? 1 : 0;
+}
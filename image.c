@@ -0,0 +1,830 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "storage.h"
+
+const int CACHE_SHARDS    = 16;
+const int CACHE_SHARD_MIN = 4; // Slots per shard at the least
+const int STRIPE_MAP_MAX  = 32768; // Stripe units mapped at most, each is a mapping
+
+// A block held in the cache. Slots a thread got pointers into are pinned
+// until that thread lets go of them.
+typedef struct cache_slot {
+    int block;           // Block held, -1 if empty
+    int ref;             // Used since the clock hand last passed
+    int dirty;           // Changed since it was last written out
+    int pins;            // Threads holding pointers into it
+    unsigned long owner; // Thread that pinned it last, 0 once it let go
+} cache_slot;
+
+// Blocks map to a shard by number, each shard owns a range of slots
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    int first;
+    int count;
+    int hand;
+} cache_shard;
+
+// Block needed when every slot of its shard was pinned, it lives until
+// the last thread holding it lets go. Unused entries have block -1.
+typedef struct cache_extra {
+    int block;
+    int dirty;
+    int pins;
+    unsigned long owner;
+    void* data;
+} cache_extra;
+
+static int image_fd    = -1;
+static int cached      = 0;
+static int scratch     = 0; // Held in anonymous memory, fd is -1 unless it gets saved
+static int readonly    = 0; // Mapped or read, never written
+static void* meta      = 0;
+static size_t meta_len = 0;
+static void* blocks    = 0; // Mapped block area, or the slot arena
+static int block_len   = 0;
+static int block_total = 0;
+
+// Files the block area is spread over, the first also holds the metadata.
+// Stripe units of stripe_len blocks go round them in turn.
+static int* member_fds   = &image_fd;
+static int member_count  = 1;
+static int stripe_len    = 0;
+
+static cache_slot* slots   = 0;
+static cache_shard* shards = 0;
+static int slot_count      = 0;
+static int shard_len       = 0; // Slots per shard
+static int* slot_of        = 0; // Slot of each block, past slot_count for extras, or -1
+
+static cache_extra* extras = 0;
+static int extra_count     = 0;
+static int extra_cap       = 0;
+static pthread_mutex_t extra_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Slots and extras the calling thread has pinned, in the order it got
+// them, so several threads can each let go of their own
+static unsigned long owner_count = 0;
+static __thread unsigned long pin_owner = 0;
+static __thread int* pinned  = 0;
+static __thread int pin_count = 0;
+static __thread int pin_cap   = 0;
+
+// Get the member file holding given block and its offset there
+static int
+block_member(int block_num, off_t* offset)
+{
+    if (member_count == 1)
+    {
+        *offset = meta_len + (off_t)block_num * block_len;
+        return 0;
+    }
+
+    int unit = block_num / stripe_len;
+    int member = unit % member_count;
+    *offset = (off_t)(unit / member_count * stripe_len + block_num % stripe_len) * block_len;
+    if (member == 0)
+    {
+        *offset += meta_len;
+    }
+    return member;
+}
+
+// Count blocks from given one, up to count, that follow each other in
+// the same member file
+static int
+run_length(int block_num, int count)
+{
+    if (member_count == 1)
+    {
+        return count;
+    }
+
+    int run = stripe_len - block_num % stripe_len;
+    return run < count ? run : count;
+}
+
+// Grow each member to hold every block it gets, files are never shrunk
+// so a mount with the wrong members can't cut an image short
+static void
+size_members()
+{
+    off_t* lens = calloc(member_count, sizeof(off_t));
+    lens[0] = meta_len;
+    for (int i = 0; i < block_total; i++)
+    {
+        off_t offset;
+        int member = block_member(i, &offset);
+        if (offset + block_len > lens[member])
+        {
+            lens[member] = offset + block_len;
+        }
+    }
+
+    for (int m = 0; m < member_count; m++)
+    {
+        struct stat st;
+        int rv = fstat(member_fds[m], &st);
+        assert(rv == 0);
+        if (st.st_size < lens[m] && readonly)
+        {
+            fprintf(stderr, "image: member %d is cut short\n", m);
+            exit(1);
+        }
+        else if (st.st_size < lens[m])
+        {
+            // Sized without writing, it reads back as zeros
+            rv = ftruncate(member_fds[m], lens[m]);
+            assert(rv == 0);
+        }
+    }
+    free(lens);
+}
+
+// Read or write len bytes at given offset of a file, there are no short
+// transfers on a regular file short of I/O errors
+static void
+file_io(int write, int fd, void* data, size_t len, off_t offset)
+{
+    ssize_t done = write ? pwrite(fd, data, len, offset)
+                         : pread(fd, data, len, offset);
+    if (done != (ssize_t)len)
+    {
+        perror("image");
+        abort();
+    }
+}
+
+// Read or write a whole block on its member
+static void
+block_io(int write, int block_num, void* data)
+{
+    off_t offset;
+    int fd = member_fds[block_member(block_num, &offset)];
+    file_io(write, fd, data, block_len, offset);
+}
+
+// Map the whole image, with its metadata faulted in if asked to. Huge
+// pages don't apply, the page cache backs a file mapping with 4K pages.
+// A striped image gets one address range with each stripe unit mapped
+// over it from its member, so blocks still sit in order.
+static void
+open_mapped(int fd, size_t size, int flags)
+{
+    int prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+    if (member_count == 1)
+    {
+        meta = mmap(0, size, prot, MAP_SHARED, fd, 0);
+        assert(meta != MAP_FAILED);
+    }
+    else
+    {
+        // The kernel only allows so many mappings per process
+        int units = (block_total + stripe_len - 1) / stripe_len;
+        if (units > STRIPE_MAP_MAX)
+        {
+            fprintf(stderr, "image: %d stripe units are too many to map, "
+                    "use a bigger unit or the block cache\n", units);
+            exit(1);
+        }
+
+        meta = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(meta != MAP_FAILED);
+        void* head = mmap(meta, meta_len, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+        assert(head == meta);
+
+        for (int i = 0; i < block_total; i += stripe_len)
+        {
+            off_t offset;
+            int member = block_member(i, &offset);
+            int count = run_length(i, block_total - i);
+            void* unit = meta + meta_len + (size_t)i * block_len;
+            void* got = mmap(unit, (size_t)count * block_len, prot,
+                             MAP_SHARED | MAP_FIXED, member_fds[member], offset);
+            assert(got == unit);
+        }
+    }
+    blocks = meta + meta_len;
+
+    if (flags & STORAGE_POPULATE)
+    {
+        void* hot = mmap(meta, meta_len, prot, MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0);
+        assert(hot == meta);
+    }
+}
+
+// Keep the whole image in anonymous memory, loading what its file holds
+// if there is one. Holes in the file were never saved and stay zeros.
+static void
+open_scratch(int fd, size_t size, int flags)
+{
+    meta = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(meta != MAP_FAILED);
+    blocks = meta + meta_len;
+
+    if (flags & STORAGE_HUGEPAGES)
+    {
+        madvise(meta, size, MADV_HUGEPAGE);
+    }
+
+    if (fd == -1)
+    {
+        return;
+    }
+
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end > (off_t)size)
+    {
+        end = size;
+    }
+
+    off_t data = lseek(fd, 0, SEEK_DATA);
+    while (data >= 0 && data < end)
+    {
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole > end)
+        {
+            hole = end;
+        }
+        file_io(0, fd, meta + data, hole - data, data);
+        data = lseek(fd, hole, SEEK_DATA);
+    }
+}
+
+// Read metadata into memory and set up empty slots for blocks
+static void
+open_cached(int block_count, int cache_blocks)
+{
+    meta = malloc(meta_len);
+    ssize_t got = pread(image_fd, meta, meta_len, 0);
+    assert(got == (ssize_t)meta_len);
+
+    int per_shard = (cache_blocks + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    if (per_shard < CACHE_SHARD_MIN)
+    {
+        per_shard = CACHE_SHARD_MIN;
+    }
+    slot_count = per_shard * CACHE_SHARDS;
+    shard_len  = per_shard;
+
+    blocks = aligned_alloc(block_len, (size_t)slot_count * block_len);
+    slots = malloc(slot_count * sizeof(cache_slot));
+    for (int i = 0; i < slot_count; i++)
+    {
+        slots[i].block = -1;
+        slots[i].ref   = 0;
+        slots[i].dirty = 0;
+        slots[i].pins  = 0;
+        slots[i].owner = 0;
+    }
+
+    shards = calloc(CACHE_SHARDS, sizeof(cache_shard));
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].first = i * per_shard;
+        shards[i].count = per_shard;
+    }
+
+    slot_of = malloc(block_count * sizeof(int));
+    memset(slot_of, 0xff, block_count * sizeof(int));
+}
+
+// Open the image in fd, metadata first and then block_count blocks. A
+// cache size of 0 maps it, anything else caches that many blocks.
+void
+image_open(int fd, size_t meta_size, int block_count, int block_size, int flags,
+           int cache_blocks)
+{
+    image_fd    = fd;
+    meta_len    = meta_size;
+    block_len   = block_size;
+    block_total = block_count;
+    scratch     = (flags & STORAGE_SCRATCH) != 0;
+    readonly    = (flags & STORAGE_READONLY) != 0;
+    cached      = cache_blocks > 0 && !scratch;
+    member_fds[0] = fd;
+
+    if (scratch)
+    {
+        open_scratch(fd, meta_size + (size_t)block_count * block_size, flags);
+        return;
+    }
+
+    size_members();
+    if (cached)
+    {
+        open_cached(block_count, cache_blocks);
+    }
+    else
+    {
+        open_mapped(fd, meta_size + (size_t)block_count * block_size, flags);
+    }
+}
+
+// Spread the block area over count more files in units of stripe_blocks,
+// called before image_open. Each member can sit on its own disk, so runs
+// of blocks are read and written on all of them at once.
+void
+image_stripe(const int* fds, int count, int stripe_blocks)
+{
+    member_count = count + 1;
+    member_fds = malloc(member_count * sizeof(int));
+    memcpy(member_fds + 1, fds, count * sizeof(int));
+    stripe_len = stripe_blocks;
+}
+
+// Check if the image goes through the block cache
+int
+image_cached()
+{
+    return cached;
+}
+
+// Get pointer to the metadata at the start of the image
+void*
+image_meta()
+{
+    return meta;
+}
+
+// Put part of the metadata on disk now, for changes that have to be
+// there before any block is
+void
+image_meta_sync(void* ptr, size_t len)
+{
+    if (scratch)
+    {
+        return;
+    }
+
+    if (cached)
+    {
+        ssize_t done = pwrite(image_fd, ptr, len, ptr - meta);
+        assert(done == (ssize_t)len);
+        fdatasync(image_fd);
+        return;
+    }
+
+    // msync takes whole pages
+    size_t page = sysconf(_SC_PAGESIZE);
+    void* start = meta + (ptr - meta) / page * page;
+    msync(start, ptr + len - start, MS_SYNC);
+}
+
+// Hold a block outside the slots until nobody is using it, reusing an
+// entry let go of before
+static int
+add_extra(int block_num)
+{
+    pthread_mutex_lock(&extra_lock);
+    int i = 0;
+    while (i < extra_count && extras[i].block != -1)
+    {
+        i++;
+    }
+
+    if (i == extra_count && extra_count == extra_cap)
+    {
+        extra_cap = extra_cap ? extra_cap * 2 : 16;
+        extras = realloc(extras, extra_cap * sizeof(cache_extra));
+    }
+    if (i == extra_count)
+    {
+        extra_count++;
+    }
+
+    cache_extra* extra = extras + i;
+    extra->block = block_num;
+    extra->dirty = 0;
+    extra->pins  = 0;
+    extra->owner = 0;
+    extra->data  = aligned_alloc(block_len, block_len);
+    void* data = extra->data;
+    pthread_mutex_unlock(&extra_lock);
+
+    block_io(0, block_num, data);
+    return slot_count + i;
+}
+
+// Pin a slot or extra for the calling thread, once however often it is
+// asked for until the thread lets go
+static void
+pin(int slot, int* pins, unsigned long* owner)
+{
+    if (!pin_owner)
+    {
+        pin_owner = __atomic_add_fetch(&owner_count, 1, __ATOMIC_RELAXED);
+    }
+
+    if (*owner == pin_owner)
+    {
+        return;
+    }
+    (*pins)++;
+    *owner = pin_owner;
+
+    if (pin_count == pin_cap)
+    {
+        pin_cap = pin_cap ? pin_cap * 2 : 64;
+        pinned = realloc(pinned, pin_cap * sizeof(int));
+    }
+    pinned[pin_count++] = slot;
+}
+
+// Let go of a slot or extra the calling thread pinned. An extra nobody
+// holds any more goes back to the file.
+static void
+unpin(int slot)
+{
+    if (slot < slot_count)
+    {
+        cache_shard* shard = shards + slot / shard_len;
+        pthread_mutex_lock(&shard->lock);
+        slots[slot].pins--;
+        if (slots[slot].owner == pin_owner)
+        {
+            slots[slot].owner = 0;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    // Still pinned, so its block can't change under us
+    pthread_mutex_lock(&extra_lock);
+    int block_num = extras[slot - slot_count].block;
+    pthread_mutex_unlock(&extra_lock);
+
+    cache_shard* shard = shards + block_num % CACHE_SHARDS;
+    pthread_mutex_lock(&shard->lock);
+    pthread_mutex_lock(&extra_lock);
+
+    cache_extra* extra = extras + slot - slot_count;
+    extra->pins--;
+    if (extra->owner == pin_owner)
+    {
+        extra->owner = 0;
+    }
+
+    if (extra->pins == 0)
+    {
+        if (extra->dirty)
+        {
+            block_io(1, block_num, extra->data);
+        }
+        slot_of[block_num] = -1;
+        free(extra->data);
+        extra->data  = NULL;
+        extra->block = -1;
+    }
+
+    pthread_mutex_unlock(&extra_lock);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Find a slot of the shard for a block, sweeping the clock hand past
+// recently used slots and never taking a pinned one
+static int
+fill_slot(cache_shard* shard, int block_num)
+{
+    for (int step = 0; step < 2 * shard->count; step++)
+    {
+        int i = shard->first + shard->hand;
+        shard->hand = (shard->hand + 1) % shard->count;
+
+        cache_slot* slot = slots + i;
+        if (slot->pins)
+        {
+            continue;
+        }
+
+        if (slot->ref)
+        {
+            slot->ref = 0;
+            continue;
+        }
+
+        void* data = blocks + (size_t)i * block_len;
+        if (slot->block != -1)
+        {
+            if (slot->dirty)
+            {
+                block_io(1, slot->block, data);
+            }
+            slot_of[slot->block] = -1;
+        }
+
+        block_io(0, block_num, data);
+        slot->block = block_num;
+        slot->dirty = 0;
+        return i;
+    }
+
+    return add_extra(block_num);
+}
+
+// Get pointer to given block, reading it in if it isn't cached
+void*
+image_block(int block_num)
+{
+    if (!cached)
+    {
+        return blocks + (size_t)block_num * block_len;
+    }
+
+    cache_shard* shard = shards + block_num % CACHE_SHARDS;
+    pthread_mutex_lock(&shard->lock);
+
+    int slot = slot_of[block_num];
+    if (slot == -1)
+    {
+        slot = fill_slot(shard, block_num);
+        slot_of[block_num] = slot;
+    }
+
+    void* data;
+    if (slot < slot_count)
+    {
+        slots[slot].ref = 1;
+        pin(slot, &slots[slot].pins, &slots[slot].owner);
+        data = blocks + (size_t)slot * block_len;
+    }
+    else
+    {
+        pthread_mutex_lock(&extra_lock);
+        cache_extra* extra = extras + slot - slot_count;
+        pin(slot, &extra->pins, &extra->owner);
+        data = extra->data;
+        pthread_mutex_unlock(&extra_lock);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return data;
+}
+
+// Get number of the block a pointer from image_block points into, or -1
+// for memory that isn't part of the image
+int
+image_block_of(void* ptr)
+{
+    size_t block_bytes = (size_t)(cached ? slot_count : block_total) * block_len;
+    if (ptr >= blocks && ptr < blocks + block_bytes)
+    {
+        int i = (ptr - blocks) / block_len;
+        return cached ? slots[i].block : i;
+    }
+
+    if (!cached)
+    {
+        return -1;
+    }
+
+    int block_num = -1;
+    pthread_mutex_lock(&extra_lock);
+    for (int i = 0; i < extra_count; i++)
+    {
+        if (extras[i].block != -1
+            && ptr >= extras[i].data && ptr < extras[i].data + block_len)
+        {
+            block_num = extras[i].block;
+        }
+    }
+    pthread_mutex_unlock(&extra_lock);
+    return block_num;
+}
+
+// Note that a cached block has changed and has to be written out
+void
+image_dirty(int block_num)
+{
+    if (!cached)
+    {
+        return;
+    }
+
+    cache_shard* shard = shards + block_num % CACHE_SHARDS;
+    pthread_mutex_lock(&shard->lock);
+
+    int slot = slot_of[block_num];
+    if (slot >= slot_count)
+    {
+        pthread_mutex_lock(&extra_lock);
+        extras[slot - slot_count].dirty = 1;
+        pthread_mutex_unlock(&extra_lock);
+    }
+    else if (slot != -1)
+    {
+        slots[slot].dirty = 1;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Pass an madvise hint for a run of blocks on, as the matching
+// posix_fadvise hint for a cached image
+void
+image_advise(int block_num, int count, int advice)
+{
+    if (!cached)
+    {
+        madvise(blocks + (size_t)block_num * block_len, (size_t)count * block_len, advice);
+        return;
+    }
+
+    int fadvice = advice == MADV_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+                : advice == MADV_WILLNEED   ? POSIX_FADV_WILLNEED
+                : advice == MADV_RANDOM     ? POSIX_FADV_RANDOM
+                : POSIX_FADV_NORMAL;
+    while (count > 0)
+    {
+        off_t offset;
+        int member = block_member(block_num, &offset);
+        int run = run_length(block_num, count);
+        posix_fadvise(member_fds[member], offset, (off_t)run * block_len, fadvice);
+        block_num += run;
+        count -= run;
+    }
+}
+
+// Get a mark for the blocks the calling thread has pinned so far, to let
+// go of the ones it pins after with image_unpin
+int
+image_pins()
+{
+    return pin_count;
+}
+
+// Let go of blocks the calling thread pinned since the mark, for long
+// operations that are done with them. Pointers it got before stay good.
+void
+image_unpin(int mark)
+{
+    while (pin_count > mark)
+    {
+        unpin(pinned[--pin_count]);
+    }
+}
+
+// End of an operation, pointers the calling thread got so far are no
+// longer used. Its slots come unpinned and blocks held outside them go
+// back to the file once no other thread holds them.
+void
+image_release()
+{
+    image_unpin(0);
+}
+
+// Write every changed block out, then the metadata
+void
+image_writeback()
+{
+    if (!cached)
+    {
+        return;
+    }
+
+    for (int s = 0; s < CACHE_SHARDS; s++)
+    {
+        cache_shard* shard = shards + s;
+        pthread_mutex_lock(&shard->lock);
+        for (int i = shard->first; i < shard->first + shard->count; i++)
+        {
+            if (slots[i].dirty)
+            {
+                block_io(1, slots[i].block, blocks + (size_t)i * block_len);
+                slots[i].dirty = 0;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&extra_lock);
+    for (int i = 0; i < extra_count; i++)
+    {
+        if (extras[i].block != -1 && extras[i].dirty)
+        {
+            block_io(1, extras[i].block, extras[i].data);
+            extras[i].dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&extra_lock);
+
+    ssize_t done = pwrite(image_fd, meta, meta_len, 0);
+    assert(done == (ssize_t)meta_len);
+}
+
+// Wait until everything written so far is on disk. A striped image is
+// synced one member at a time rather than one stripe unit mapping at a
+// time, syncing a file writes back its shared mappings too.
+void
+image_sync()
+{
+    if (scratch)
+    {
+        return;
+    }
+
+    if (!cached && member_count == 1)
+    {
+        msync(meta, meta_len + (size_t)block_total * block_len, MS_SYNC);
+        return;
+    }
+
+    for (int m = 0; m < member_count; m++)
+    {
+        fdatasync(member_fds[m]);
+    }
+}
+
+// Write a block out now if the cache holds it changed
+static void
+write_back(int block_num)
+{
+    cache_shard* shard = shards + block_num % CACHE_SHARDS;
+    pthread_mutex_lock(&shard->lock);
+
+    int slot = slot_of[block_num];
+    if (slot >= slot_count)
+    {
+        pthread_mutex_lock(&extra_lock);
+        cache_extra* extra = extras + slot - slot_count;
+        if (extra->dirty)
+        {
+            block_io(1, block_num, extra->data);
+            extra->dirty = 0;
+        }
+        pthread_mutex_unlock(&extra_lock);
+    }
+    else if (slot != -1 && slots[slot].dirty)
+    {
+        block_io(1, block_num, blocks + (size_t)slot * block_len);
+        slots[slot].dirty = 0;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Put a run of blocks on disk now, for data that has to be there before
+// anything pointing at it
+void
+image_sync_blocks(int block_num, int count)
+{
+    if (scratch)
+    {
+        return;
+    }
+
+    if (!cached && member_count == 1)
+    {
+        msync(blocks + (size_t)block_num * block_len, (size_t)count * block_len, MS_SYNC);
+        return;
+    }
+
+    for (int i = block_num; cached && i < block_num + count; i++)
+    {
+        write_back(i);
+    }
+
+    for (int m = 0; m < member_count; m++)
+    {
+        fdatasync(member_fds[m]);
+    }
+}
+
+// Write a scratch image out to its file, the blocks marked used and then
+// the metadata. Other blocks are punched out and read back as zeros.
+void
+image_save(const char* used)
+{
+    if (!scratch || image_fd == -1)
+    {
+        return;
+    }
+
+    size_members();
+    for (int i = 0; i < block_total; i++)
+    {
+        off_t offset;
+        block_member(i, &offset);
+        if (used[i])
+        {
+            file_io(1, image_fd, blocks + (size_t)i * block_len, block_len, offset);
+        }
+        else
+        {
+            fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, block_len);
+        }
+    }
+
+    file_io(1, image_fd, meta, meta_len, 0);
+    fsync(image_fd);
+}
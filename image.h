@@ -0,0 +1,40 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+
+// Access to the image file, laid out as metadata followed by blocks.
+//
+// A mapped image is one shared mapping the kernel pages in and writes back
+// as it sees fit, until image_sync waits for it. A cached image is read
+// and written with pread/pwrite through a fixed number of block slots,
+// split into shards with a lock and CLOCK hand each, so memory use is
+// capped however large the image is. Pointers to blocks stay good until
+// the thread that got them calls image_release, or image_unpin with a
+// mark taken before. Either way the block area can be striped over
+// several files. A scratch image lives in anonymous memory and only
+// touches its file when loaded and saved.
+//
+// Pins are kept per thread so threads reading blocks at once, like the
+// fsck checksum threads, don't let go of each other's. Storage above this
+// isn't thread safe otherwise, nufs runs single threaded with -s.
+
+void  image_open(int fd, size_t meta_size, int block_count, int block_size, int flags,
+                 int cache_blocks);
+void  image_stripe(const int* fds, int count, int stripe_blocks);
+int   image_cached();
+void* image_meta();
+void  image_meta_sync(void* ptr, size_t len);
+void* image_block(int block_num);
+int   image_block_of(void* ptr);
+void  image_dirty(int block_num);
+void  image_advise(int block_num, int count, int advice);
+int   image_pins();
+void  image_unpin(int mark);
+void  image_release();
+void  image_writeback();
+void  image_sync();
+void  image_sync_blocks(int block_num, int count);
+void  image_save(const char* used);
+
+#endif
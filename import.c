@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+
+// Copies a host directory tree into an unmounted image. Reader threads load
+// host files ahead of the main thread, which alone touches the image and
+// writes each file whole so that it is allocated in one contiguous run.
+
+const int IMPORT_WINDOW = 64; // Files read ahead of the one being written
+
+typedef struct import_file {
+    char host[PATH_MAX];
+    char path[PATH_MAX];
+    struct stat st;
+    char* data;
+    int error;
+    int ready;
+} import_file;
+
+typedef struct import_queue {
+    import_file* files;
+    int count;
+    int cap;
+    int next_read;     // Next file a reader picks up
+    int written;       // Files the main thread is done with
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} import_queue;
+
+static void
+usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-s size] image hostdir [dir]\n", prog);
+    fprintf(stderr, "  -j threads  file reading threads (default: one per CPU)\n");
+    fprintf(stderr, "  -s size     megabytes for a new image (default: 1)\n");
+    fprintf(stderr, "  dir         directory of the image to copy into (default: /)\n");
+    exit(1);
+}
+
+// Join a directory and a name into a path
+static void
+join_path(char* out, const char* dir, const char* name)
+{
+    int len = strlen(dir);
+    snprintf(out, PATH_MAX, "%s%s%s", dir, len && dir[len - 1] == '/' ? "" : "/", name);
+}
+
+// Make directories of the image for the host tree under host, queueing
+// the files found for the readers
+static int
+scan_tree(import_queue* queue, const char* host, const char* path)
+{
+    DIR* dir = opendir(host);
+    if (!dir)
+    {
+        perror(host);
+        return 1;
+    }
+
+    int errors = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)))
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        import_file file;
+        memset(&file, 0, sizeof(file));
+        join_path(file.host, host, ent->d_name);
+        join_path(file.path, path, ent->d_name);
+
+        if (lstat(file.host, &file.st) != 0)
+        {
+            perror(file.host);
+            errors++;
+            continue;
+        }
+
+        if (S_ISDIR(file.st.st_mode))
+        {
+            int rv = make_inode(file.path, S_IFDIR | (file.st.st_mode & 07777));
+            if (rv != 0 && rv != -EEXIST)
+            {
+                fprintf(stderr, "%s: %s\n", file.path, strerror(-rv));
+                errors++;
+                continue;
+            }
+            errors += scan_tree(queue, file.host, file.path);
+        }
+        else if (S_ISREG(file.st.st_mode))
+        {
+            if (queue->count == queue->cap)
+            {
+                queue->cap = queue->cap ? queue->cap * 2 : 256;
+                queue->files = realloc(queue->files, queue->cap * sizeof(import_file));
+            }
+            queue->files[queue->count++] = file;
+        }
+        else
+        {
+            fprintf(stderr, "%s: skipped, not a regular file or directory\n", file.host);
+        }
+    }
+
+    closedir(dir);
+    return errors;
+}
+
+// Read a whole host file into memory
+static int
+load_file(import_file* file)
+{
+    int fd = open(file->host, O_RDONLY);
+    if (fd < 0)
+    {
+        return errno;
+    }
+
+    file->data = malloc(file->st.st_size ? file->st.st_size : 1);
+    off_t done = 0;
+    while (done < file->st.st_size)
+    {
+        ssize_t got = pread(fd, file->data + done, file->st.st_size - done, done);
+        if (got <= 0)
+        {
+            int err = got < 0 ? errno : EIO;
+            close(fd);
+            return err;
+        }
+        done += got;
+    }
+
+    close(fd);
+    return 0;
+}
+
+// Reader thread, loads files in queue order staying within the window
+static void*
+read_files(void* arg)
+{
+    import_queue* queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->next_read < queue->count)
+    {
+        if (queue->next_read >= queue->written + IMPORT_WINDOW)
+        {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+            continue;
+        }
+
+        import_file* file = queue->files + queue->next_read++;
+        pthread_mutex_unlock(&queue->lock);
+
+        int error = load_file(file);
+
+        pthread_mutex_lock(&queue->lock);
+        file->error = error;
+        file->ready = 1;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+// Create a loaded file in the image
+static int
+store_file(import_file* file)
+{
+    if (file->error)
+    {
+        return -file->error;
+    }
+
+    int rv = make_inode(file->path, S_IFREG | (file->st.st_mode & 07777));
+    if (rv != 0)
+    {
+        return rv;
+    }
+
+    inode* node = get_inode(file->path);
+    if (file->st.st_size)
+    {
+        rv = write_data(node, file->data, file->st.st_size, 0);
+        if (rv < 0)
+        {
+            return rv;
+        }
+    }
+
+    // Everything is pending, flushing now lays the file out in one go
+    rv = flush_inode(node);
+    inode_changed(node);
+    node->mtime = file->st.st_mtim.tv_sec;
+    node->mtime_nsec = file->st.st_mtim.tv_nsec;
+    return rv;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            storage_size(atol(optarg) * 1024 * 1024);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 2 || argc - optind > 3 || threads < 1)
+    {
+        usage(argv[0]);
+    }
+
+    const char* image = argv[optind];
+    const char* host = argv[optind + 1];
+    const char* dest = argc - optind == 3 ? argv[optind + 2] : "/";
+
+    storage_init(image, 0);
+
+    inode* root = get_inode(dest);
+    if (!root || !root->isdir || inode_read_only(root))
+    {
+        fprintf(stderr, "%s: not a writable directory of the image\n", dest);
+        return 1;
+    }
+
+    import_queue queue;
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+
+    int errors = scan_tree(&queue, host, dest);
+
+    pthread_t* ids = calloc(threads, sizeof(pthread_t));
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_create(&ids[t], NULL, read_files, &queue);
+    }
+
+    // Write files in the order they were found as readers finish them
+    int stored = 0;
+    long bytes = 0;
+    for (int i = 0; i < queue.count; i++)
+    {
+        import_file* file = queue.files + i;
+
+        pthread_mutex_lock(&queue.lock);
+        while (!file->ready)
+        {
+            pthread_cond_wait(&queue.changed, &queue.lock);
+        }
+        pthread_mutex_unlock(&queue.lock);
+
+        int rv = store_file(file);
+        storage_release();
+        if (rv != 0)
+        {
+            fprintf(stderr, "%s: %s\n", file->path, strerror(-rv));
+            errors++;
+        }
+        else
+        {
+            stored++;
+            bytes += file->st.st_size;
+        }
+
+        free(file->data);
+        file->data = NULL;
+
+        pthread_mutex_lock(&queue.lock);
+        queue.written++;
+        pthread_cond_broadcast(&queue.changed);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+    }
+    free(ids);
+    free(queue.files);
+
+    storage_flush();
+
+    printf("%d files, %ld bytes imported, %d errors\n", stored, bytes, errors);
+    return errors ? 1 : 0;
+}
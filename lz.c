@@ -0,0 +1,224 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+const int LZ_MIN_MATCH  = 4;
+const int LZ_HASH_BITS  = 12;
+const int LZ_MAX_OFFSET = 65535;
+
+// Hash the four bytes at p into the match table
+static int
+lz_hash(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length that didn't fit in its token nibble
+static uint8_t*
+lz_put_length(uint8_t* op, const uint8_t* end, int len)
+{
+    while (len >= 255 && op < end)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    if (op < end)
+    {
+        *op++ = len;
+    }
+    return op;
+}
+
+// Emit one sequence of literals followed by a match, or NULL if it won't fit
+static uint8_t*
+lz_put_sequence(uint8_t* op, const uint8_t* end, const uint8_t* lit, int lit_len,
+                int offset, int match_len)
+{
+    // Worst case for the lengths and offset
+    if (end - op < 1 + lit_len + lit_len / 255 + match_len / 255 + 4)
+    {
+        return NULL;
+    }
+
+    uint8_t* token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+    {
+        op = lz_put_length(op, end, lit_len - 15);
+    }
+
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    // Final sequence has literals only
+    if (!match_len)
+    {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15)
+    {
+        op = lz_put_length(op, end, match_len - 15);
+    }
+
+    return op;
+}
+
+// Compress len bytes of src into dst, return compressed size or 0 if it
+// doesn't fit in cap bytes
+int
+lz_compress(const void* src, int len, void* dst, int cap)
+{
+    const uint8_t* ip     = src;
+    const uint8_t* anchor = src;
+    const uint8_t* in_end = ip + len;
+    uint8_t* op           = dst;
+    uint8_t* out_end      = op + cap;
+
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= in_end)
+    {
+        int h = lz_hash(ip);
+        int candidate = table[h];
+        table[h] = ip - (const uint8_t*)src;
+
+        const uint8_t* ref = (const uint8_t*)src + candidate;
+        if (candidate < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        // Extend match as far as it goes
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < in_end && ref[match_len] == ip[match_len])
+        {
+            match_len++;
+        }
+
+        op = lz_put_sequence(op, out_end, anchor, ip - anchor, ip - ref, match_len);
+        if (!op)
+        {
+            return 0;
+        }
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    // Whatever is left goes out as literals
+    op = lz_put_sequence(op, out_end, anchor, in_end - anchor, 0, 0);
+    if (!op)
+    {
+        return 0;
+    }
+
+    return op - (uint8_t*)dst;
+}
+
+// Read a length that didn't fit in its token nibble, -1 if input runs out
+static int
+lz_get_length(const uint8_t** ip, const uint8_t* end)
+{
+    int len = 0;
+    int byte;
+    do
+    {
+        if (*ip >= end)
+        {
+            return -1;
+        }
+        byte = *(*ip)++;
+        len += byte;
+    } while (byte == 255);
+
+    return len;
+}
+
+// Decompress len bytes of src into dst, return decompressed size or -1 if
+// the input is malformed or needs more than cap bytes
+int
+lz_decompress(const void* src, int len, void* dst, int cap)
+{
+    const uint8_t* ip     = src;
+    const uint8_t* in_end = ip + len;
+    uint8_t* op           = dst;
+    uint8_t* out_end      = op + cap;
+
+    while (ip < in_end)
+    {
+        int token = *ip++;
+
+        // Literals
+        int lit_len = token >> 4;
+        if (lit_len == 15)
+        {
+            int extra = lz_get_length(&ip, in_end);
+            if (extra < 0)
+            {
+                return -1;
+            }
+            lit_len += extra;
+        }
+
+        if (lit_len > in_end - ip || lit_len > out_end - op)
+        {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // Last sequence ends with its literals
+        if (ip == in_end)
+        {
+            break;
+        }
+
+        // Match
+        if (in_end - ip < 2)
+        {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        int match_len = token & 15;
+        if (match_len == 15)
+        {
+            int extra = lz_get_length(&ip, in_end);
+            if (extra < 0)
+            {
+                return -1;
+            }
+            match_len += extra;
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op - (uint8_t*)dst || match_len > out_end - op)
+        {
+            return -1;
+        }
+
+        // Byte at a time, matches may overlap what they produce
+        const uint8_t* ref = op - offset;
+        for (int i = 0; i < match_len; i++)
+        {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return op - (uint8_t*)dst;
+}
@@ -0,0 +1,11 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Byte-oriented LZ77 codec in the style of LZ4, each sequence is a token
+// byte holding literal and match lengths, extra length bytes, the literals
+// and a two byte match offset
+
+int lz_compress(const void* src, int len, void* dst, int cap);
+int lz_decompress(const void* src, int len, void* dst, int cap);
+
+#endif
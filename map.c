@@ -1,54 +1,224 @@
 #include <stdio.h>
 #include <string.h>
-#include <assert.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "map.h"
 
-const int NAME_SIZE_LIMIT = 89;
-const int MAP_ENTRY_LIMIT = 44;
+const int MAP_BYTES = 4096; // Size of the block a map lives in
 
-int
-map_get(map* m, char* key)
+// Hash a name of given length, FNV-1a
+static uint32_t
+map_hash(const char* name, int len)
 {
-    for (int i = 0; i < m->size; i++)
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Bytes an entry with a name of given length takes, kept int aligned
+static int
+map_entry_size(int len)
+{
+    return (sizeof(int) + len + 1 + 3) & ~3;
+}
+
+// Get pointer to the entry a slot refers to
+static char*
+map_entry(map* m, int i)
+{
+    return (char*)m + m->slots[i].offset;
+}
+
+// Check if slot i holds the given name
+static int
+map_matches(map* m, int i, const char* key, int len)
+{
+    return m->slots[i].len == len && memcmp(map_entry(m, i) + sizeof(int), key, len) == 0;
+}
+
+// Find the slot holding given name, or -1. Hashes are compared four slots
+// at a time, names only when a hash matches.
+static int
+map_find(map* m, const char* key)
+{
+    int len = strlen(key);
+    uint32_t hash = map_hash(key, len);
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i want = _mm_set1_epi32(hash);
+    for (; i + 4 <= m->size; i += 4)
     {
-        entry e = m->entries[i];
-        if (strcmp(e.name, key) == 0)
+        // Gather the hash out of each of four eight byte slots
+        __m128 lo = _mm_loadu_ps((const float*)(m->slots + i));
+        __m128 hi = _mm_loadu_ps((const float*)(m->slots + i + 2));
+        __m128i hashes = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hashes, want)));
+        while (mask)
         {
-            return e.inode_num;
+            int j = i + __builtin_ctz(mask);
+            if (map_matches(m, j, key, len))
+            {
+                return j;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < m->size; i++)
+    {
+        if (m->slots[i].hash == hash && map_matches(m, i, key, len))
+        {
+            return i;
         }
     }
     return -1;
 }
 
-void
-map_add(map* m, char* name, int num)
+// Bytes free between the slots and the entries
+static int
+map_gap(map* m)
 {
-    assert(m->size < MAP_ENTRY_LIMIT);
-    strncpy(m->entries[m->size].name, name, NAME_SIZE_LIMIT);
-    m->entries[m->size].inode_num = num;
-    m->size++;
+    return MAP_BYTES - m->used - (int)(sizeof(map) + m->size * sizeof(map_slot));
 }
 
-void
-map_remove(map* m, char* key)
+// Pack entries against the end of the block, closing holes left by
+// removed ones
+static void
+map_compact(map* m)
 {
-    int found = 0;
+    char packed[MAP_BYTES];
+    int used = 0;
 
     for (int i = 0; i < m->size; i++)
     {
-        entry e = m->entries[i];
-        if (strcmp(key, e.name) == 0)
+        int size = map_entry_size(m->slots[i].len);
+        used += size;
+        memcpy(packed + MAP_BYTES - used, map_entry(m, i), size);
+        m->slots[i].offset = MAP_BYTES - used;
+    }
+
+    memcpy((char*)m + MAP_BYTES - used, packed + MAP_BYTES - used, used);
+    m->used = used;
+}
+
+int
+map_get(map* m, const char* key)
+{
+    int i = map_find(m, key);
+    return i == -1 ? -1 : map_inode(m, i);
+}
+
+// Add an entry, returning -ENAMETOOLONG or -ENOSPC if it can't be held
+int
+map_add(map* m, const char* name, int num)
+{
+    int len = strlen(name);
+    if (len > MAP_NAME_MAX)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    int size = map_entry_size(len);
+    if (map_gap(m) < size + (int)sizeof(map_slot))
+    {
+        map_compact(m);
+        if (map_gap(m) < size + (int)sizeof(map_slot))
         {
-            found = 1;
-            m->size--;
+            return -ENOSPC;
         }
+    }
+
+    m->used += size;
+    char* e = (char*)m + MAP_BYTES - m->used;
+    memcpy(e, &num, sizeof(int));
+    memcpy(e + sizeof(int), name, len + 1);
+
+    map_slot* slot = m->slots + m->size;
+    slot->hash   = map_hash(name, len);
+    slot->offset = MAP_BYTES - m->used;
+    slot->len    = len;
+    m->size++;
+
+    return 0;
+}
+
+// Point an existing entry at another inode
+void
+map_set(map* m, const char* key, int num)
+{
+    int i = map_find(m, key);
+    if (i != -1)
+    {
+        memcpy(map_entry(m, i), &num, sizeof(int));
+    }
+}
+
+// Remove an entry, the last slot moves into its place
+void
+map_remove(map* m, const char* key)
+{
+    int i = map_find(m, key);
+    if (i == -1)
+    {
+        return;
+    }
 
-        if (found)
+    // Lowest entry gives its space straight back, others leave a hole
+    if (m->slots[i].offset == MAP_BYTES - m->used)
+    {
+        m->used -= map_entry_size(m->slots[i].len);
+    }
+
+    m->slots[i] = m->slots[m->size - 1];
+    m->size--;
+}
+
+const char*
+map_name(map* m, int i)
+{
+    return map_entry(m, i) + sizeof(int);
+}
+
+int
+map_inode(map* m, int i)
+{
+    int num;
+    memcpy(&num, map_entry(m, i), sizeof(int));
+    return num;
+}
+
+// Check that slots and entries of a map are consistent with each other
+int
+map_valid(map* m)
+{
+    if (m->size < 0 || m->used < 0 || map_gap(m) < 0)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < m->size; i++)
+    {
+        map_slot* slot = m->slots + i;
+        if (slot->offset < MAP_BYTES - m->used
+            || slot->offset + map_entry_size(slot->len) > MAP_BYTES
+            || slot->len > MAP_NAME_MAX
+            || map_name(m, i)[slot->len] != 0
+            || slot->hash != map_hash(map_name(m, i), slot->len))
         {
-            m->entries[i] = m->entries[i + 1];
+            return 0;
         }
     }
+    return 1;
 }
 
 void
@@ -58,17 +228,14 @@ map_print(map* m)
     int maxlen = 0;
     for (int i = 0; i < m->size; i++)
     {
-        entry e = m->entries[i];
-        if (strlen(e.name) > maxlen)
+        if (m->slots[i].len > maxlen)
         {
-            maxlen = strlen(e.name);
+            maxlen = m->slots[i].len;
         }
     }
 
     for (int i = 0; i < m->size; i++)
     {
-        entry e = m->entries[i];
-        printf("%-*s %d\n", maxlen, e.name, e.inode_num); 
+        printf("%-*s %d\n", maxlen, map_name(m, i), map_inode(m, i));
     }
 }
-
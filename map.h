@@ -1,21 +1,40 @@
 #ifndef MAP_H
 #define MAP_H
 
-typedef struct map_entry {
-    int  inode_num;
-    char name[89];
-} entry;
+#include <stdint.h>
+
+// Longest name a directory entry can hold
+#define MAP_NAME_MAX 255
+
+// A directory fills one block. Slots grow up from the header, holding the
+// hash and place of each entry so that lookups compare hashes before
+// touching any name. Entries, an inode number and a NUL terminated name,
+// are packed down from the end of the block.
+typedef struct map_slot {
+    uint32_t hash;
+    uint16_t offset;   // Where the entry starts in the block
+    uint16_t len;      // Length of its name
+} map_slot;
 
 typedef struct map {
-    int size;
-    entry entries[44];
+    int size;          // Entries in use
+    int used;          // Bytes at the end of the block given to entries
+    map_slot slots[];
 } map;
 
-int map_get(map* m, char* key);
+int map_get(map* m, const char* key);
+
+int map_add(map* m, const char* name, int num);
+
+void map_set(map* m, const char* name, int num);
+
+void map_remove(map* m, const char* name);
+
+const char* map_name(map* m, int i);
 
-void map_add(map* m, char* name, int num);
+int map_inode(map* m, int i);
 
-void map_remove(map* m, char* name);
+int map_valid(map* m);
 
 void map_print(map* m);
 
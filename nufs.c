@@ -5,21 +5,72 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <dirent.h>
-#include <bsd/string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 29
 #include <fuse.h>
 
 #include "storage.h"
 #include "map.h"
+#include "nufs.h"
+
+// Mount options of our own, the rest are passed on to FUSE
+typedef struct nufs_opts {
+    int autodefrag;
+    int dedup;
+    int populate;
+    int hugepages;
+    int cache;         // Megabytes of block cache, 0 maps the image instead
+    char* stripe;      // More image files to stripe blocks over, colon separated
+    int stripe_unit;   // Kilobytes per stripe unit, 0 for the default
+    int scratch;       // Keep the filesystem in memory only
+    int persist;       // Scratch, but loaded from the image and saved at unmount
+    int size;          // Megabytes for an image created by this mount, 0 for 1MB
+} nufs_opts;
+
+static nufs_opts options;
+
+static struct fuse_opt nufs_opt_spec[] = {
+    { "autodefrag", offsetof(nufs_opts, autodefrag), 1 },
+    { "dedup", offsetof(nufs_opts, dedup), 1 },
+    { "populate", offsetof(nufs_opts, populate), 1 },
+    { "hugepages", offsetof(nufs_opts, hugepages), 1 },
+    { "cache=%d", offsetof(nufs_opts, cache), 0 },
+    { "stripe=%s", offsetof(nufs_opts, stripe), 0 },
+    { "stripe_unit=%d", offsetof(nufs_opts, stripe_unit), 0 },
+    { "scratch", offsetof(nufs_opts, scratch), 1 },
+    { "persist", offsetof(nufs_opts, persist), 1 },
+    { "size=%d", offsetof(nufs_opts, size), 0 },
+    FUSE_OPT_END
+};
+
+// Fragmentation score at which autodefrag rewrites a file on release
+const int AUTODEFRAG_SCORE = 25;
+
+// Get name of the snapshot path refers to, if it is directly inside the
+// snapshot directory
+static const char*
+snapshot_name(const char* path)
+{
+    int len = strlen(SNAPSHOT_DIR);
+    if (strncmp(path, SNAPSHOT_DIR "/", len + 1) != 0 || strchr(path + len + 1, '/'))
+    {
+        return NULL;
+    }
+    return path + len + 1;
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
 int
 nufs_access(const char *path, int mask)
 {
+    storage_release();
     printf("access(%s)\n", path);
     return get_inode(path) ? 0 : -ENOENT;
 }
@@ -29,6 +80,7 @@ nufs_access(const char *path, int mask)
 int
 nufs_getattr(const char *path, struct stat *st)
 {
+    storage_release();
     printf("getattr(%s)\n", path);
     inode* inode = get_inode(path);
     return inode ? get_stat(inode, st) : -ENOENT;
@@ -40,6 +92,7 @@ int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi)
 {
+    storage_release();
     printf("readdir(%s)\n", path);
 
     struct stat st;
@@ -56,12 +109,21 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     // it will return non-zero when the buffer is full
     filler(buf, ".", &st, 0);
 
+    // Snapshot directory lists snapshots, it has no map of its own
+    if (strcmp(path, SNAPSHOT_DIR) == 0)
+    {
+        for (int i = next_snapshot(0); i != -1; i = next_snapshot(i + 1))
+        {
+            filler(buf, get_snapshot_name(i), &st, 0);
+        }
+        return 0;
+    }
+
     map* dirmap = get_block_num(dir->block);
     for (int i = 0; i < dirmap->size; i++)
     {
-        entry e = dirmap->entries[i];
-        get_stat(get_inode_num(e.inode_num), &st);
-        filler(buf, e.name, &st, 0);
+        get_stat(get_entry_inode(dir, map_inode(dirmap, i)), &st);
+        filler(buf, map_name(dirmap, i), &st, 0);
     }
 
     return 0;
@@ -72,6 +134,7 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int
 nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+    storage_release();
     printf("mknod(%s, %04o)\n", path, mode);
     return make_inode(path, mode);
 }
@@ -81,13 +144,23 @@ nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 int
 nufs_mkdir(const char *path, mode_t mode)
 {
+    storage_release();
     printf("mkdir(%s, %04o)\n", path, mode);
+
+    // Making a directory in the snapshot directory takes a snapshot
+    const char* name = snapshot_name(path);
+    if (name)
+    {
+        return create_snapshot(name);
+    }
+
     return make_inode(path, S_IFDIR | mode);
 }
 
 int
 nufs_unlink(const char *path)
 {
+    storage_release();
     printf("unlink(%s)\n", path);
     return unlink_inode(path, 0);
 }
@@ -95,6 +168,7 @@ nufs_unlink(const char *path)
 int
 nufs_rmdir(const char *path)
 {
+    storage_release();
     printf("rmdir(%s)\n", path);
     if (strcmp(path + strlen(path) - 2, "..") == 0)
     {
@@ -105,26 +179,40 @@ nufs_rmdir(const char *path)
     {
         return -EINVAL;
     }
+
+    const char* name = snapshot_name(path);
+    if (name)
+    {
+        return delete_snapshot(name);
+    }
+
     return unlink_inode(path, 1);
 }
 
+// implements: man 2 statfs
+// called by df, answered from counters kept as blocks and inodes come and go
+int
+nufs_statfs(const char* path, struct statvfs* st)
+{
+    storage_release();
+    printf("statfs(%s)\n", path);
+    return get_statfs(st);
+}
+
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int
 nufs_rename(const char *from, const char *to)
 {
+    storage_release();
     printf("rename(%s => %s)\n", from, to);
-    int rv = link_inode(from, to);
-    if (rv != 0)
-        return rv;
-
-    rv = unlink_inode(from, 0);
-    return rv;
+    return rename_inode(from, to);
 }
 
 int
 nufs_chmod(const char *path, mode_t mode)
 {
+    storage_release();
     printf("chmod(%s, %04o)\n", path, mode);
     inode* inode = get_inode(path);
 
@@ -133,6 +221,12 @@ nufs_chmod(const char *path, mode_t mode)
         return -ENOENT;
     }
 
+    if (inode_read_only(inode))
+    {
+        return -EROFS;
+    }
+
+    inode_changed(inode);
     inode->mode = mode;
 
     return 0;
@@ -141,8 +235,21 @@ nufs_chmod(const char *path, mode_t mode)
 int
 nufs_truncate(const char *path, off_t size)
 {
+    storage_release();
     printf("truncate(%s, %ld bytes)\n", path, size);
-    return -1;
+    inode* inode = get_inode(path);
+
+    if (!inode)
+    {
+        return -ENOENT;
+    }
+
+    if (inode->isdir)
+    {
+        return -EISDIR;
+    }
+
+    return truncate_inode(inode, size);
 }
 
 // this is called on open, but doesn't need to do much
@@ -151,14 +258,28 @@ nufs_truncate(const char *path, off_t size)
 int
 nufs_open(const char *path, struct fuse_file_info *fi)
 {
+    storage_release();
     printf("open(%s)\n", path);
-    return get_inode(path) ? 0 : -ENOENT;
+    inode* inode = get_inode(path);
+
+    if (!inode)
+    {
+        return -ENOENT;
+    }
+
+    if (inode_read_only(inode) && (fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        return -EROFS;
+    }
+
+    return 0;
 }
 
 // Actually read data
 int
 nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    storage_release();
     printf("read(%s, %ld bytes, @%ld)\n", path, size, offset);
     inode* inode = get_inode(path);
 
@@ -167,23 +288,14 @@ nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_fi
         return -ENOENT;
     }
 
-    if (inode->size < offset)
-    {
-        return 0;
-    }
-
-    char* data = get_data(inode);
-    data += offset;
-    
-    strlcpy(buf, data, size + 1);
-    free(data - offset);
-    return size;
+    return read_data(inode, buf, size, offset);
 }
 
 // Actually write data
 int
 nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    storage_release();
     printf("write(%s, %ld bytes, @%ld)\n", path, size, offset);
     inode* inode = get_inode(path);
 
@@ -199,6 +311,7 @@ nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct
 int
 nufs_utimens(const char* path, const struct timespec ts[2])
 {
+    storage_release();
     printf("utimens(%s, [%ld, %ld; %ld %ld])\n",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec);
 
@@ -214,22 +327,161 @@ nufs_utimens(const char* path, const struct timespec ts[2])
         return -ENOENT;
     }
 
+    if (inode_read_only(inode))
+    {
+        return -EROFS;
+    }
+
+    inode_changed(inode);
     inode->mtime = ts[1].tv_sec;
+    inode->mtime_nsec = ts[1].tv_nsec;
     return 0;
 }
 
 int
 nufs_link(const char* from, const char* to)
 {
+    storage_release();
     return link_inode(from, to);
 }
 
+// implements: man 2 fallocate
+// preallocates blocks or punches holes
+int
+nufs_fallocate(const char* path, int mode, off_t offset, off_t length,
+               struct fuse_file_info* fi)
+{
+    storage_release();
+    printf("fallocate(%s, %d, %ld bytes, @%ld)\n", path, mode, length, offset);
+    inode* inode = get_inode(path);
+
+    if (!inode)
+    {
+        return -ENOENT;
+    }
+
+    if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+    {
+        return punch_hole(inode, offset, length);
+    }
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    return preallocate_inode(inode, offset, length, mode & FALLOC_FL_KEEP_SIZE);
+}
+
+// Requests from our client tools
+int
+nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
+           unsigned int flags, void* data)
+{
+    storage_release();
+    printf("ioctl(%s, %x)\n", path, cmd);
+    inode* inode = get_inode(path);
+
+    if (!inode)
+    {
+        return -ENOENT;
+    }
+
+    // chattr +c turns on compression for data written from then on
+    if ((unsigned int)cmd == FS_IOC_GETFLAGS)
+    {
+        *(unsigned int*)data = (inode->flags & INODE_COMPRESSED) ? FS_COMPR_FL : 0;
+        return 0;
+    }
+
+    if ((unsigned int)cmd == FS_IOC_SETFLAGS)
+    {
+        if (inode_read_only(inode))
+        {
+            return -EROFS;
+        }
+
+        unsigned int fs_flags = *(unsigned int*)data;
+        if (fs_flags & ~FS_COMPR_FL)
+        {
+            return -EOPNOTSUPP;
+        }
+
+        inode_changed(inode);
+        if (fs_flags & FS_COMPR_FL)
+        {
+            inode->flags |= INODE_COMPRESSED;
+        }
+        else
+        {
+            inode->flags &= ~INODE_COMPRESSED;
+        }
+        return 0;
+    }
+
+    if (cmd == NUFS_IOC_CLONE)
+    {
+        nufs_clone_args* args = data;
+        args->src[sizeof(args->src) - 1] = 0;
+
+        struct inode* src = get_inode(args->src);
+        return src ? clone_inode(src, inode) : -ENOENT;
+    }
+
+    return -ENOTTY;
+}
+
+// Give blocks to delayed writes when a file is closed
+int
+nufs_flush(const char* path, struct fuse_file_info* fi)
+{
+    storage_release();
+    printf("flush(%s)\n", path);
+    inode* inode = get_inode(path);
+    return inode ? flush_inode(inode) : 0;
+}
+
+int
+nufs_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    storage_release();
+    printf("fsync(%s)\n", path);
+    inode* inode = get_inode(path);
+    return inode ? sync_inode(inode) : -ENOENT;
+}
+
+// Last close of a file, rewrite it contiguously if asked to
+int
+nufs_release(const char* path, struct fuse_file_info* fi)
+{
+    storage_release();
+    printf("release(%s)\n", path);
+    inode* inode = get_inode(path);
+
+    if (inode && options.autodefrag && fragmentation_score(inode) >= AUTODEFRAG_SCORE)
+    {
+        defrag_inode(inode);
+    }
+
+    return 0;
+}
+
+// Nothing may stay in memory past unmount
+void
+nufs_destroy(void* private_data)
+{
+    printf("destroy()\n");
+    storage_flush();
+    storage_save();
+}
+
 void
 nufs_init_ops(struct fuse_operations* ops)
 {
     memset(ops, 0, sizeof(struct fuse_operations));
     ops->access   = nufs_access;
     ops->getattr  = nufs_getattr;
+    ops->statfs   = nufs_statfs;
     ops->readdir  = nufs_readdir;
     ops->mknod    = nufs_mknod;
     ops->mkdir    = nufs_mkdir;
@@ -243,6 +495,12 @@ nufs_init_ops(struct fuse_operations* ops)
     ops->write    = nufs_write;
     ops->utimens  = nufs_utimens;
     ops->link     = nufs_link;
+    ops->fallocate = nufs_fallocate;
+    ops->flush    = nufs_flush;
+    ops->fsync    = nufs_fsync;
+    ops->release  = nufs_release;
+    ops->ioctl    = nufs_ioctl;
+    ops->destroy  = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
@@ -250,9 +508,56 @@ struct fuse_operations nufs_ops;
 int
 main(int argc, char *argv[])
 {
-    assert(argc > 2 && argc < 6);
-    storage_init(argv[--argc]);
+    assert(argc > 2);
+    const char* image = argv[--argc];
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, nufs_opt_spec, NULL) == -1)
+    {
+        return 1;
+    }
+
+    int flags = 0;
+    if (options.populate)
+    {
+        flags |= STORAGE_POPULATE;
+    }
+    if (options.hugepages && !options.scratch && !options.persist)
+    {
+        fprintf(stderr, "hugepages only applies to scratch images, ignored\n");
+    }
+    if (options.hugepages)
+    {
+        flags |= STORAGE_HUGEPAGES;
+    }
+    if (options.scratch || options.persist)
+    {
+        flags |= STORAGE_SCRATCH;
+    }
+    if (options.persist)
+    {
+        flags |= STORAGE_PERSIST;
+    }
+    if (options.size)
+    {
+        storage_size(options.size * 1024L * 1024);
+    }
+    if (options.cache)
+    {
+        storage_cache(options.cache * 1024L * 1024);
+    }
+    if (options.stripe)
+    {
+        storage_stripe(options.stripe, options.stripe_unit * 1024L);
+    }
+    storage_init(image, flags);
+
+    if (options.dedup)
+    {
+        storage_dedup();
+    }
+
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
 
@@ -0,0 +1,16 @@
+#ifndef NUFS_H
+#define NUFS_H
+
+#include <sys/ioctl.h>
+
+// ioctl interface between the nufs daemon and its client tools
+
+// Path of a file relative to the root of the mount
+typedef struct nufs_clone_args {
+    char src[4096];
+} nufs_clone_args;
+
+// Turn the file the ioctl is issued on into a copy-on-write clone of src
+#define NUFS_IOC_CLONE _IOW('N', 1, nufs_clone_args)
+
+#endif
@@ -5,615 +5,3983 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <sys/mman.h>
 
 #include "storage.h"
 #include "vector.h"
 #include "map.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "image.h"
 
 // Constants
-const int NUFS_SIZE      = 1024 * 1024; // 1MB
-const int INODE_COUNT    = 112;
-const int BLOCK_COUNT    = 254;
+const long NUFS_SIZE     = 1024 * 1024; // New images when no size is given, 1MB
 const int BLOCK_SIZE     = 4096;
 const int INDIRECT_COUNT = 4096 / 4;
+const int BLOCK_NONE     = -1; // Unallocated block in a block map
+const int BLOCK_COMPRESSED = -2; // Slot past the data of a compressed cluster
+const off_t MAX_FILE_SIZE = (1 + 4096 / 4) * 4096L;
+const int DELALLOC_MAX   = 256; // Most pending blocks per file, a megabyte
+const int SNAPSHOT_COUNT = 8;
+const int NUFS_MAGIC     = 0x5346554e; // "NUFS"
+const int NUFS_VERSION   = 10;
+const int INODES_PER_CHUNK = 4096 / sizeof(inode);
+const int CHUNKS_PER_LIST  = 4096 / 4 - 1;
+const int CLUSTER_BLOCKS = 4; // File blocks compressed together
+const int CLUSTER_CACHE_SIZE = 8;
+const int DEDUP_BUCKETS = 256;
+const int SEQUENTIAL_READS = 2;  // Reads in a row that make a file sequential
+const int RANDOM_READS     = 4;  // Reads out of order that make it random
+const int READAHEAD_MIN    = 4;  // First readahead window in blocks
+const int READAHEAD_MAX    = 64;
+const int STRIPE_BLOCKS    = 16; // Stripe unit when none is given
+const int DELTA_MAGIC      = 0x544c4544; // "DELT"
+
+// Checksum state of a block since mount
+const char CSUM_UNCHECKED = 0; // Not read yet, checked on first read
+const char CSUM_CHECKED   = 1; // Matches its checksum
+const char CSUM_DIRTY     = 2; // Changed, checksum gets redone on flush
+
+// Start of the image, saying what it holds and where the inode table is.
+// The table is made of chunks taken from the block area as it grows, and
+// listed in a chain of blocks starting from here.
+typedef struct superblock {
+    int magic;
+    int version;
+    int block_count;
+    int inode_chunks;   // Chunks of the inode table in use
+    int free_blocks;    // Free counts as of the last flush
+    int free_inodes;
+    int stripe_files;   // Files the block area is striped over besides this one
+    int stripe_blocks;  // Blocks per stripe unit, 0 if not striped
+    int generation;     // Checkpoint changed blocks are tracked since
+    int chunk_list;     // First block listing chunks, BLOCK_NONE before any
+} superblock;
+
+// Block listing the blocks that hold chunks of the inode table, in order
+typedef struct chunk_list {
+    int next;           // Block listing the chunks after these, or BLOCK_NONE
+    int chunks[4096 / 4 - 1];
+} chunk_list;
+
+// A frozen copy of the inode table, sharing all blocks with the live tree
+// until either side changes them
+typedef struct snapshot {
+    char   name[48];
+    time_t created;
+    int    table;    // First block of frozen inode table, BLOCK_NONE if unused
+    int    blocks;   // Length of frozen inode table in blocks
+} snapshot;
+
+// Start of a stream of the blocks changed between two generations. Each
+// block follows as a record and its data, blocks sent without data are
+// zeros. A record for block -1 ends them. Then come the superblock and
+// snapshot table, and the block map entries of blocks whose data or
+// reference count changed, up to an entry for block -1.
+typedef struct delta_header {
+    int magic;
+    int version;
+    int from;           // Generation the stream goes on top of, 0 for a full copy
+    int to;
+    int block_count;
+    int meta_size;
+} delta_header;
+
+typedef struct delta_record {
+    int block;
+    int has_data;
+} delta_record;
+
+typedef struct delta_entry {
+    int block;
+    int refs;
+    unsigned int checksum;
+    int written;
+} delta_entry;
 
 // Global Pointers for Future Retrievals  
-static int* inode_map_base = 0;
+static superblock* sb = 0;
 static int* block_map_base = 0;
-static inode* inode_base   = 0;
-static void* block_base    = 0;
-
-// Check bitmap for freeness of given inode number
+static int* sealed_base = 0;
+static unsigned int* checksum_base = 0;
+static snapshot* snapshot_base = 0;
+static unsigned char* written_base = 0; // Bit per block ever changed since mkfs
+static unsigned char* changed_base = 0; // Bit per block changed since the checkpoint
+static unsigned char* recounted_base = 0; // Bit per block recounted since the checkpoint
+static size_t meta_size = 0;            // Bytes of metadata before the blocks
+static int block_count = 0;             // Blocks in the image, from the superblock
+
+// Size of an image created by storage_init, 0 for the default
+static long new_size = 0;
+
+// Blocks the image is read through instead of being mapped, 0 to map it
+static int cache_blocks = 0;
+
+// More image files the block area is striped over, NULL for none
+static vector* stripe_paths = 0;
+static int stripe_blocks = 0;
+
+// Memory-only image to be written to its file at unmount
+static int save_on_close = 0;
+
+// Checksum of a block of zeros, which is what blocks never written hold.
+// Stored checksums are taken relative to it, so they start out as zeros
+// and creating an image doesn't have to write them.
+static unsigned int zero_crc = 0;
+
+// Inodes in the live table and how many the per-inode state has room for,
+// the chunk each block holds or -1, and a stack of free inode numbers with
+// the lowest on top
+static int inode_count = 0;
+static int inode_room = 0;
+static int* chunk_of_block = 0;
+static int* free_inodes = 0;
+static int free_inode_count = 0;
+
+// Block of each chunk of the inode table, and the blocks listing them,
+// read from the chunk list at mount
+static int* chunk_blocks = 0;
+static int* list_blocks = 0;
+
+// Stands in for the directory holding all snapshots
+static inode snapshot_dir;
+
+// Checksum state of each block, and how many are dirty
+static char* block_state = 0;
+static int dirty_blocks = 0;
+
+// Whether checksums could be trusted at mount
+static int mounted_clean = 0;
+
+// Free blocks, and how many of them are promised to delayed writes
+static int free_block_count = 0;
+static int reserved_blocks  = 0;
+
+// Writes into holes are held in memory and only given blocks on flush,
+// so that each file gets laid out in one contiguous run. A file without
+// an indirect block also holds a reservation for one, which flush places
+// right in front of the data.
+typedef struct delalloc {
+    int count;
+    int indirect;
+    void* pages[1 + 4096 / 4];
+} delalloc;
+
+static delalloc** pending = 0;
+
+// Pending blocks a file may hold before it gets flushed, an eighth of the
+// image so that a few busy files can't take up all of free space
+static int delalloc_limit = 0;
+
+// Recently decompressed clusters, known by the first block of their
+// compressed data, which never changes while the block is in use
+typedef struct cluster_entry {
+    int block;
+    unsigned long used;
+    void* data;
+} cluster_entry;
+
+static cluster_entry* cluster_cache = 0;
+static unsigned long cluster_clock  = 0;
+
+// Content hashes of file data blocks, so flush can share a block already
+// holding the same data instead of writing another copy. Entries can go
+// stale when a block changes in place, matches are always verified.
+typedef struct dedup_entry {
+    unsigned long hash;
+    int next;    // Next block in the same bucket, BLOCK_NONE at the end
+    int indexed;
+} dedup_entry;
+
+static int dedup_enabled = 0;
+static int* dedup_buckets = 0;
+static dedup_entry* dedup_index = 0;
+
+// How each file has been read lately, to tell streaming from random access
+typedef struct access_pattern {
+    off_t next;   // Offset a sequential read would start at
+    int streak;   // Sequential reads in a row, negative for random ones
+    int window;   // Blocks advised ahead of a sequential reader
+    int ahead;    // First file block past what has been advised
+} access_pattern;
+
+static access_pattern* patterns = 0;
+
+// Check for freeness of given inode number, free inodes have no type.
+// Scans call it for every inode, so it lets go of what it pinned.
 static int
 check_inode_free(int inode_num)
 {
-    return !inode_map_base[inode_num];
+    int mark = image_pins();
+    int unused = get_inode_num(inode_num)->mode == 0;
+    image_unpin(mark);
+    return unused;
 }
 
-// Check bit for freeness of given block number
+// Check block map for freeness of given block number, the map holds
+// how many block maps refer to each block
 static int
 check_block_free(int block_num)
 {
     return !block_map_base[block_num];
 }
 
-// Allocate a new inode and return its number
+// Check if given block may hold anything but zeros. Blocks nothing was
+// ever written to are still holes in the sparse image.
 static int
-allocate_inode()
+block_written(int block_num)
+{
+    return written_base[block_num / 8] & (1 << block_num % 8);
+}
+
+// Check if given block changed since the last checkpoint
+static int
+block_changed(int block_num)
+{
+    return changed_base[block_num / 8] & (1 << block_num % 8);
+}
+
+// Note that given block has to go in the next stream of changes
+static void
+mark_changed(int block_num)
+{
+    changed_base[block_num / 8] |= 1 << block_num % 8;
+}
+
+// Check if the reference count of given block changed since the last
+// checkpoint
+static int
+block_recounted(int block_num)
+{
+    return recounted_base[block_num / 8] & (1 << block_num % 8);
+}
+
+// Note that the block map entry of given block has to go in the next
+// stream of changes, while its data doesn't
+static void
+mark_recounted(int block_num)
 {
-    for (int i = 0; i < INODE_COUNT; i++)
+    recounted_base[block_num / 8] |= 1 << block_num % 8;
+}
+
+// Take another reference to a block in use
+static void
+add_ref(int block_num)
+{
+    block_map_base[block_num]++;
+    mark_recounted(block_num);
+}
+
+// Note that given block may no longer be all zeros
+static void
+mark_written(int block_num)
+{
+    written_base[block_num / 8] |= 1 << block_num % 8;
+    mark_changed(block_num);
+}
+
+// Get pointer to given block for changing it, marking its checksum stale
+// until the next flush
+static void*
+get_block_writable(int block_num)
+{
+    mark_written(block_num);
+
+    if (block_state[block_num] != CSUM_DIRTY)
     {
-        if (check_inode_free(i))
+        block_state[block_num] = CSUM_DIRTY;
+        dirty_blocks++;
+    }
+
+    if (*sealed_base)
+    {
+        *sealed_base = 0;
+        image_meta_sync(sealed_base, sizeof(int));
+    }
+
+    void* block = get_block_num(block_num);
+    image_dirty(block_num);
+    return block;
+}
+
+// Get checksum of given block as it is stored, letting go of the block
+// after so sealing and rebuilding every checksum stay within the cache
+static unsigned int
+block_checksum(int block_num)
+{
+    int mark = image_pins();
+    unsigned int crc = crc32c(0, get_block_num(block_num), BLOCK_SIZE) ^ zero_crc;
+    image_unpin(mark);
+    return crc;
+}
+
+// Store checksums of every block changed since the last flush, along
+// with the free counts that go with them
+static void
+seal_checksums()
+{
+    sb->free_blocks = free_block_count;
+    sb->free_inodes = free_inode_count;
+
+    // Nothing was written since the last seal, only the counts go out
+    if (*sealed_base)
+    {
+        image_writeback();
+        return;
+    }
+
+    for (int i = 0; i < block_count && dirty_blocks; i++)
+    {
+        if (block_state[i] == CSUM_DIRTY)
         {
-            inode_map_base[i] = 1;
-            memset(inode_base + i, 0, sizeof(inode));
-            return i;
+            checksum_base[i] = block_checksum(i);
+            block_state[i] = CSUM_CHECKED;
+            dirty_blocks--;
         }
     }
-    return -1;
+
+    // Blocks and their checksums reach the disk before the flag saying
+    // they match, a crash in between leaves the image unsealed
+    image_writeback();
+    image_sync();
+    *sealed_base = 1;
+    image_meta_sync(sealed_base, sizeof(int));
+}
+
+// Check a block against its checksum the first time it is read after
+// mount, block numbers out of range are corrupt too
+static int
+verify_block(int block_num)
+{
+    if (block_num < 0 || block_num >= block_count)
+    {
+        return -EIO;
+    }
+
+    if (block_state[block_num] != CSUM_UNCHECKED)
+    {
+        return 0;
+    }
+
+    int rv = check_block(block_num);
+    if (rv == 0)
+    {
+        block_state[block_num] = CSUM_CHECKED;
+    }
+    return rv;
+}
+
+// Claim a free block, leaving what it holds to the caller
+static void
+claim_block(int block_num)
+{
+    block_map_base[block_num] = 1;
+    mark_recounted(block_num);
+    free_block_count--;
+}
+
+// Zero out a claimed block, unless it never held anything
+static void
+clear_block(int block_num)
+{
+    if (block_written(block_num))
+    {
+        memset(get_block_writable(block_num), 0, BLOCK_SIZE);
+    }
 }
 
-// Allocate a new block and return its number
+// Allocate a new block and return its number, callers fill it or clear it
 static int
 allocate_block()
 {
-    for (int i = 0; i < BLOCK_COUNT; i++)
+    // Blocks promised to pending writes are off limits
+    if (free_block_count - reserved_blocks < 1)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < block_count; i++)
     {
         if (check_block_free(i))
         {
-            block_map_base[i] = 1;
-            memset(block_base + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            claim_block(i);
             return i;
         }
     }
     return -1;
 }
 
-// Initialize Filesystem
-void
-storage_init(const char* path)
+// Find a run of up to count contiguous free blocks, preferring one that
+// starts at goal, and return its start with its length in *len
+static int
+find_run(int goal, int count, int* len)
 {
-    // Are we setting up for first time?
-    int setup = 0;
+    int best = -1;
+    int best_len = 0;
 
-    // Only create new file
-    int nufs_fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
-
-    // File already exists(probably)
-    if (nufs_fd == -1)
+    if (goal < 0 || goal >= block_count)
     {
-        // Open file 
-        nufs_fd = open(path, O_RDWR);
-        assert(nufs_fd != -1);
+        goal = 0;
     }
-    else
+
+    // Scan from goal to the end then wrap, taking the first run long enough
+    int i = 0;
+    while (i < block_count && best_len < count)
     {
-        // File created let's zero it out
-        char buff[NUFS_SIZE];
-        memset(buff, 0, NUFS_SIZE);
-        write(nufs_fd, buff, NUFS_SIZE);
+        int start = (goal + i) % block_count;
+        int run = 0;
+        while (run < count && i + run < block_count && start + run < block_count
+               && check_block_free(start + run))
+        {
+            run++;
+        }
 
-        // Setting up for first time
-        setup = 1;
+        if (run > best_len)
+        {
+            best = start;
+            best_len = run;
+        }
+        i += run ? run : 1;
     }
 
-    // Truncate to write size
-    int rv = ftruncate(nufs_fd, NUFS_SIZE);
-    assert(rv == 0);
+    *len = best_len;
+    return best;
+}
 
-    // Map file into memory
-    inode_map_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, nufs_fd, 0);
-    assert(inode_map_base != MAP_FAILED);
+// Allocate a run of up to count contiguous blocks, preferring one that
+// starts at goal, and return its start with its length in *len. Callers
+// fill the blocks or clear them.
+static int
+allocate_run(int goal, int count, int* len)
+{
+    int start = find_run(goal, count, len);
+    for (int j = 0; j < *len; j++)
+    {
+        claim_block(start + j);
+    }
 
-    // Set Pointers for future retrievals
-    block_map_base = inode_map_base + INODE_COUNT;
-    inode_base = (inode*)(block_map_base + BLOCK_COUNT);
-    block_base = (void*)(inode_base + INODE_COUNT);
+    return start;
+}
 
-    // Set up root directory
-    if (setup)
+// Note which block holds given chunk and make room in the per-inode state
+// for its inodes, doubling it as the table grows
+static void
+track_chunk(int chunk, int block_num)
+{
+    inode_count = (chunk + 1) * INODES_PER_CHUNK;
+    if (inode_count > inode_room)
     {
-        assert(allocate_inode() == 0);
-        inode_base->mode     = S_IFDIR | 0755;
-        inode_base->uid      = getuid();
-        inode_base->size     = 4;
-        inode_base->mtime    = time(0);
-        inode_base->gid      = getgid();
-        inode_base->refs     = 2;
-        inode_base->blocks   = 1;
-        inode_base->isdir    = 1;
-        inode_base->block    = allocate_block();
-        inode_base->indirect = -1;
+        inode_room = inode_room ? inode_room * 2 : INODES_PER_CHUNK;
+        chunk_blocks = realloc(chunk_blocks, inode_room / INODES_PER_CHUNK * sizeof(int));
+        pending = realloc(pending, inode_room * sizeof(delalloc*));
+        patterns = realloc(patterns, inode_room * sizeof(access_pattern));
+        free_inodes = realloc(free_inodes, inode_room * sizeof(int));
     }
+
+    chunk_blocks[chunk] = block_num;
+    chunk_of_block[block_num] = chunk;
+
+    int first = chunk * INODES_PER_CHUNK;
+    memset(pending + first, 0, INODES_PER_CHUNK * sizeof(delalloc*));
+    memset(patterns + first, 0, INODES_PER_CHUNK * sizeof(access_pattern));
 }
 
-// Get pointer for block of given number
-void*
-get_block_num(int block_num)
+// Add a chunk of free inodes to the end of the table, along with a new
+// block to list it in when the last one is full
+static int
+grow_inode_table()
 {
-    return block_base + block_num * BLOCK_SIZE;
+    int chunk = sb->inode_chunks;
+    int list = chunk / CHUNKS_PER_LIST;
+    int new_list = chunk % CHUNKS_PER_LIST == 0;
+    if (free_block_count - reserved_blocks < 1 + new_list)
+    {
+        return -1;
+    }
+
+    if (new_list)
+    {
+        int list_num = allocate_block();
+        memset(get_block_writable(list_num), 0xff, BLOCK_SIZE);
+        if (list == 0)
+        {
+            sb->chunk_list = list_num;
+        }
+        else
+        {
+            ((chunk_list*)get_block_writable(list_blocks[list - 1]))->next = list_num;
+        }
+
+        list_blocks = realloc(list_blocks, (list + 1) * sizeof(int));
+        list_blocks[list] = list_num;
+    }
+
+    int block_num = allocate_block();
+    clear_block(block_num);
+
+    // Inodes are changed in place from here on
+    mark_written(block_num);
+
+    ((chunk_list*)get_block_writable(list_blocks[list]))->chunks[chunk % CHUNKS_PER_LIST] = block_num;
+    sb->inode_chunks++;
+    track_chunk(chunk, block_num);
+
+    for (int i = inode_count - 1; i >= chunk * INODES_PER_CHUNK; i--)
+    {
+        free_inodes[free_inode_count++] = i;
+    }
+    return 0;
 }
 
-// Get pointer for inode of given number
-inode*
-get_inode_num(int inode_num)
+// Allocate a new inode and return its number, growing the table if all
+// are in use
+static int
+allocate_inode()
 {
-    return inode_base + inode_num;
+    if (!free_inode_count && grow_inode_table() != 0)
+    {
+        return -1;
+    }
+
+    int inode_num = free_inodes[--free_inode_count];
+    memset(get_inode_writable(inode_num), 0, sizeof(inode));
+    memset(patterns + inode_num, 0, sizeof(access_pattern));
+    return inode_num;
 }
 
-// Get inode pointer for given path
-inode*
-get_inode(const char* path)
+// Return an inode to the free stack
+static void
+free_inode(int inode_num)
 {
-    // Split Path by directory delimiters
-    vector* dirs = str_split(path, '/');
+    memset(get_inode_writable(inode_num), 0, sizeof(inode));
+    free_inodes[free_inode_count++] = inode_num;
+}
 
-    // Start at root directory
-    inode* it = inode_base;
+// Set modification time of given inode to now
+static void
+stamp_mtime(inode* inode)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    inode_changed(inode);
+    inode->mtime = now.tv_sec;
+    inode->mtime_nsec = now.tv_nsec;
+}
 
-    // Return root directory if asked for
-    if (strcmp("/", path) == 0)
+// Drop cached data of the compressed cluster starting at given block
+static void
+forget_cluster(int block_num)
+{
+    for (int i = 0; i < CLUSTER_CACHE_SIZE; i++)
     {
-        // Clean Up
-        delete_vector(dirs);
-
-        return it;
+        if (cluster_cache[i].block == block_num)
+        {
+            cluster_cache[i].block = BLOCK_NONE;
+        }
     }
+}
 
-    // Loop through path until found
-    for (int path_iter = 0; path_iter < dirs->size; path_iter++)
+// Hash a block worth of data a word at a time
+static unsigned long
+hash_block(const void* data)
+{
+    const unsigned long* words = data;
+    unsigned long hash = 14695981039346656037UL;
+    for (int i = 0; i < BLOCK_SIZE / sizeof(unsigned long); i++)
     {
-        // Get next directory/filename
-        char* name = vector_get(dirs, path_iter);
+        hash = (hash ^ words[i]) * 1099511628211UL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
 
-        // We are in a directory
-        if (it->isdir)
-        {
-            // Find block containing directory map
-            map* dirmap = get_block_num(it->block);
+// Add a block holding data with given hash to the dedup index
+static void
+dedup_add(int block_num, unsigned long hash)
+{
+    if (!dedup_enabled || dedup_index[block_num].indexed)
+    {
+        return;
+    }
 
-            // Get inode number for next directory/filename
-            int inode_num = map_get(dirmap, name);
+    int bucket = hash % DEDUP_BUCKETS;
+    dedup_index[block_num].hash    = hash;
+    dedup_index[block_num].next    = dedup_buckets[bucket];
+    dedup_index[block_num].indexed = 1;
+    dedup_buckets[bucket] = block_num;
+}
 
-            // Check for Failure
-            if (inode_num == -1)
-            {
-                // Clean Up
-                delete_vector(dirs);
+// Take a block out of the dedup index, once its data is gone or changing
+static void
+dedup_forget(int block_num)
+{
+    if (!dedup_enabled || !dedup_index[block_num].indexed)
+    {
+        return;
+    }
 
-                return NULL;
-            }
+    int* link = &dedup_buckets[dedup_index[block_num].hash % DEDUP_BUCKETS];
+    while (*link != block_num)
+    {
+        link = &dedup_index[*link].next;
+    }
+    *link = dedup_index[block_num].next;
+    dedup_index[block_num].indexed = 0;
+}
 
-            // Move to next directory
-            it = get_inode_num(inode_num);
+// Find a block holding exactly given data, or BLOCK_NONE
+static int
+dedup_find(const void* data, unsigned long hash)
+{
+    int block_num = dedup_buckets[hash % DEDUP_BUCKETS];
+    while (block_num != BLOCK_NONE)
+    {
+        if (dedup_index[block_num].hash == hash
+            && memcmp(get_block_num(block_num), data, BLOCK_SIZE) == 0)
+        {
+            return block_num;
         }
+        block_num = dedup_index[block_num].next;
+    }
+    return BLOCK_NONE;
+}
 
+// Drop a reference to a block, releasing it to the free pool with the last
+static void
+free_block(int block_num)
+{
+    block_map_base[block_num]--;
+    mark_recounted(block_num);
+    if (!block_map_base[block_num])
+    {
+        free_block_count++;
+        forget_cluster(block_num);
+        dedup_forget(block_num);
     }
+}
 
-    // Clean Up
-    delete_vector(dirs);
+// Check if a block map slot refers to a block
+static int
+block_mapped(int block_num)
+{
+    return block_num >= 0;
+}
 
-    // Return where we got out of iteration loop
-    return it;
+// Check if a block is referred to from more than one block map
+static int
+check_block_shared(int block_num)
+{
+    return block_map_base[block_num] > 1;
 }
 
-// Make an inode at the given path and return its number
-int
-make_inode(const char* path, mode_t mode)
+// Replace a shared block with a private copy placed near goal
+static int
+copy_shared_block(int* block_num, int goal)
 {
-    int inode_num = -1;
+    if (!check_block_shared(*block_num))
+    {
+        return 0;
+    }
 
-    // Split Path by directory delimiters
-    vector* dirs = str_split(path, '/');
+    if (free_block_count - reserved_blocks < 1)
+    {
+        return -ENOSPC;
+    }
 
-    // Start at root directory
-    inode* it = inode_base;
+    int len;
+    int copy = allocate_run(goal, 1, &len);
+    memcpy(get_block_writable(copy), get_block_num(*block_num), BLOCK_SIZE);
+    free_block(*block_num);
+    *block_num = copy;
 
-    // Loop through path until found
-    for (int path_iter = 0; path_iter < dirs->size; path_iter++)
+    return 0;
+}
+
+// Get pointer to the block map slot for the given block of a file, the
+// direct block is index 0 and the rest live in the indirect block. Slots
+// asked for as writable get an indirect block of this file's own.
+static int*
+get_block_slot(inode* inode, int index, int writable)
+{
+    if (index == 0)
     {
-        // Get next directory/filename
-        char* name = vector_get(dirs, path_iter);
+        return &inode->block;
+    }
 
-        // We are in a directory
-        if (it->isdir)
+    if (index > INDIRECT_COUNT)
+    {
+        return NULL;
+    }
+
+    // Allocate indirect block if necessary, all slots start unallocated
+    if (inode->indirect == BLOCK_NONE)
+    {
+        if (!writable)
         {
-            // Find block containing directory map
-            map* dirmap = get_block_num(it->block);
+            return NULL;
+        }
 
-            // Get inode number for next directory/filename
-            int inode_num = map_get(dirmap, name);
+        inode->indirect = allocate_block();
+        if (inode->indirect == BLOCK_NONE)
+        {
+            return NULL;
+        }
+        memset(get_block_writable(inode->indirect), 0xff, BLOCK_SIZE);
+    }
 
-            // Last piece of path
-            if (path_iter == dirs->size - 1)
-            {
-                // Already Exists
-                if (inode_num != -1)
-                {
-                    // Clean Up
-                    delete_vector(dirs);
+    // Don't change a block map a snapshot still refers to
+    if (writable && copy_shared_block(&inode->indirect, inode->indirect) != 0)
+    {
+        return NULL;
+    }
 
-                    return -EEXIST;
-                }
+    int* block_nums = writable ? get_block_writable(inode->indirect)
+                               : get_block_num(inode->indirect);
+    return block_nums + index - 1;
+}
 
-                // Make node
-                inode_num = allocate_inode();
+// Bytes of metadata in front of an image of given block count, padded so
+// that each block starts on a page
+static size_t
+meta_bytes(int count)
+{
+    size_t bytes = sizeof(superblock)
+                 + SNAPSHOT_COUNT * sizeof(snapshot)
+                 + count * sizeof(int) + sizeof(int)       // Reference counts, sealed
+                 + count * sizeof(unsigned int)            // Checksums
+                 + 3 * ((count + 7) / 8);                  // Written, changed and recounted bits
+    return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
 
-                if (inode_num == -1)
-                {
-                    // Clean Up
-                    delete_vector(dirs);
+// Most blocks an image of given size holds along with their metadata
+static int
+blocks_for_size(long bytes)
+{
+    long count = bytes / BLOCK_SIZE;
+    while (count > 0 && meta_bytes(count) + count * BLOCK_SIZE > bytes)
+    {
+        count--;
+    }
+    return count;
+}
 
-                    return -EDQUOT;
-                }
+// Make images created by storage_init given size in bytes, called before
+// it. An existing image keeps the size it was made with.
+void
+storage_size(long bytes)
+{
+    new_size = bytes;
+}
 
-                inode* inode = get_inode_num(inode_num);
-                inode->mode  = mode;
-                inode->uid   = getuid();
-                inode->size  = S_ISDIR(mode) ? 4 : 0;
-                inode->mtime = time(0);
-                inode->gid   = getgid();
-                inode->refs  = S_ISDIR(mode) ? 2 : 1;
-                inode->isdir = S_ISDIR(mode);
-                inode->block = allocate_block();
-                inode->indirect = -1;
+// Read the image through a cache of given size instead of mapping it,
+// called before storage_init
+void
+storage_cache(long bytes)
+{
+    cache_blocks = bytes / BLOCK_SIZE;
+}
 
-                if (inode->block == -1)
-                {
-                    // Clean Up
-                    delete_vector(dirs);
+// Stripe the block area over more image files, given as a colon separated
+// list, in units of given size or the default for 0. Called before
+// storage_init, and every mount of the image has to give the same ones.
+void
+storage_stripe(const char* paths, long unit_bytes)
+{
+    stripe_paths = str_split(paths, ':');
+    stripe_blocks = unit_bytes ? unit_bytes / BLOCK_SIZE : STRIPE_BLOCKS;
+    if (stripe_blocks < 1)
+    {
+        stripe_blocks = 1;
+    }
+}
 
-                    return -EDQUOT;
-                }
+// Let go of block pointers handed out so far, called between operations
+// so a cached image can reuse their memory
+void
+storage_release()
+{
+    image_release();
+}
 
-                inode->blocks = 1;
+// Get a mark for the block pointers handed out so far
+int
+storage_pins()
+{
+    return image_pins();
+}
 
-                map_add(dirmap, name, inode_num);
-                it->refs++;
-                
+// Let go of block pointers handed out since the mark, between the steps
+// of a long operation. Pointers from before it stay good.
+void
+storage_unpin(int mark)
+{
+    image_unpin(mark);
+}
+
+// Initialize Filesystem
+void
+storage_init(const char* path, int flags)
+{
+    // Are we setting up for first time?
+    int setup = 0;
+    int nufs_fd = -1;
+
+    // A scratch image without persist never touches its file
+    if ((flags & STORAGE_SCRATCH) && !(flags & STORAGE_PERSIST))
+    {
+        setup = 1;
+    }
+    else if (flags & STORAGE_READONLY)
+    {
+        nufs_fd = open(path, O_RDONLY);
+        if (nufs_fd == -1)
+        {
+            perror(path);
+            exit(1);
+        }
+    }
+    else
+    {
+        // Only create new file
+        nufs_fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+
+        // File already exists(probably)
+        if (nufs_fd == -1)
+        {
+            // Open file 
+            nufs_fd = open(path, O_RDWR);
+            assert(nufs_fd != -1);
+        }
+        else
+        {
+            // Setting up for first time
+            setup = 1;
+        }
+    }
+    save_on_close = (flags & STORAGE_SCRATCH) && (flags & STORAGE_PERSIST);
+
+    // A new image gets the size asked for, an existing one says its own
+    if (setup)
+    {
+        block_count = blocks_for_size(new_size ? new_size : NUFS_SIZE);
+    }
+    else
+    {
+        superblock head;
+        if (pread(nufs_fd, &head, sizeof(head), 0) != sizeof(head)
+            || head.magic != NUFS_MAGIC || head.version != NUFS_VERSION)
+        {
+            fprintf(stderr, "%s: not a nufs image of version %d\n", path, NUFS_VERSION);
+            exit(1);
+        }
+        block_count = head.block_count;
+    }
+
+    // Room for the root directory and the first inode chunk at least
+    if (block_count < 2)
+    {
+        fprintf(stderr, "%s: image too small\n", path);
+        exit(1);
+    }
+
+    delalloc_limit = block_count / 8;
+    if (delalloc_limit > DELALLOC_MAX)
+    {
+        delalloc_limit = DELALLOC_MAX;
+    }
+    if (delalloc_limit < 1)
+    {
+        delalloc_limit = 1;
+    }
+
+    // Members of a new image start out empty, so blocks never written
+    // read back as zeros there too
+    int stripe_files = stripe_paths ? stripe_paths->size : 0;
+    if (stripe_files && (flags & STORAGE_SCRATCH))
+    {
+        fprintf(stderr, "%s: a scratch image can't be striped\n", path);
+        exit(1);
+    }
+
+    if (stripe_files)
+    {
+        int* fds = malloc(stripe_files * sizeof(int));
+        for (int i = 0; i < stripe_files; i++)
+        {
+            const char* member = vector_get(stripe_paths, i);
+            fds[i] = (flags & STORAGE_READONLY) ? open(member, O_RDONLY)
+                   : open(member, O_CREAT | O_RDWR | (setup ? O_TRUNC : 0), 0644);
+            if (fds[i] == -1)
+            {
+                perror(member);
+                exit(1);
+            }
+        }
+        image_stripe(fds, stripe_files, stripe_blocks);
+        free(fds);
+    }
+
+    // Map file into memory, or read it through the block cache, sizing a
+    // new image without writing it. Blocks fill the end of the image, so
+    // each one is exactly a page.
+    meta_size = meta_bytes(block_count);
+    image_open(nufs_fd, meta_size, block_count, BLOCK_SIZE, flags, cache_blocks);
+    sb = image_meta();
+
+    // Set Pointers for future retrievals
+    snapshot_base = (snapshot*)(sb + 1);
+    block_map_base = (int*)(snapshot_base + SNAPSHOT_COUNT);
+    sealed_base = block_map_base + block_count;
+    checksum_base = (unsigned int*)(sealed_base + 1);
+    written_base = (unsigned char*)(checksum_base + block_count);
+    changed_base = written_base + (block_count + 7) / 8;
+    recounted_base = changed_base + (block_count + 7) / 8;
+
+    // Blocks never written are all zeros, so is their checksum
+    void* zeros = calloc(1, BLOCK_SIZE);
+    zero_crc = crc32c(0, zeros, BLOCK_SIZE);
+    free(zeros);
+
+    if (setup)
+    {
+        sb->magic       = NUFS_MAGIC;
+        sb->version     = NUFS_VERSION;
+        sb->block_count = block_count;
+        sb->stripe_files  = stripe_files;
+        sb->stripe_blocks = stripe_files ? stripe_blocks : 0;
+        sb->chunk_list    = BLOCK_NONE;
+        *sealed_base = 1;
+    }
+
+    // Blocks can only be found with the striping they were written with
+    if (sb->stripe_files != stripe_files
+        || (stripe_files && sb->stripe_blocks != stripe_blocks))
+    {
+        fprintf(stderr, "%s: striped over %d more files in units of %d blocks, "
+                "mounted with %d in units of %d\n", path, sb->stripe_files,
+                sb->stripe_blocks, stripe_files, stripe_blocks);
+        exit(1);
+    }
+
+    // Count free blocks for write reservations
+    for (int i = 0; i < block_count; i++)
+    {
+        free_block_count += check_block_free(i);
+    }
+
+    // Index the inode table from its chunk list, nothing is pending at mount
+    chunk_of_block = malloc(block_count * sizeof(int));
+    memset(chunk_of_block, 0xff, block_count * sizeof(int));
+    int list_num = sb->chunk_list;
+    int mark = image_pins();
+    for (int c = 0; c < sb->inode_chunks; c++)
+    {
+        int list = c / CHUNKS_PER_LIST;
+        if (c % CHUNKS_PER_LIST == 0)
+        {
+            list_num = list ? ((chunk_list*)get_block_num(list_num))->next : sb->chunk_list;
+            list_blocks = realloc(list_blocks, (list + 1) * sizeof(int));
+            list_blocks[list] = list_num;
+        }
+
+        int block_num = list_num < 0 || list_num >= block_count ? BLOCK_NONE
+                      : ((chunk_list*)get_block_num(list_num))->chunks[c % CHUNKS_PER_LIST];
+        if (block_num < 0 || block_num >= block_count)
+        {
+            fprintf(stderr, "%s: inode chunk list broken at chunk %d\n", path, c);
+            exit(1);
+        }
+        track_chunk(c, block_num);
+        image_unpin(mark);
+    }
+
+    // The inode table lives in blocks, read it in along with the metadata
+    if (flags & STORAGE_POPULATE)
+    {
+        for (int l = 0; l < (sb->inode_chunks + CHUNKS_PER_LIST - 1) / CHUNKS_PER_LIST; l++)
+        {
+            image_advise(list_blocks[l], 1, MADV_WILLNEED);
+        }
+        for (int c = 0; c < sb->inode_chunks; c++)
+        {
+            image_advise(chunk_blocks[c], 1, MADV_WILLNEED);
+        }
+    }
+
+    for (int i = inode_count - 1; i >= 0; i--)
+    {
+        if (check_inode_free(i))
+        {
+            free_inodes[free_inode_count++] = i;
+        }
+    }
+
+    // Counts saved with the checksums should match what was found
+    if (!setup && *sealed_base
+        && (sb->free_blocks != free_block_count || sb->free_inodes != free_inode_count))
+    {
+        fprintf(stderr, "%s: free counts were %d blocks and %d inodes, found %d and %d\n",
+                path, sb->free_blocks, sb->free_inodes, free_block_count, free_inode_count);
+    }
+
+    // Checksums left stale by a crash can't be told from corruption, so
+    // they are redone from scratch, unless the image is only looked at.
+    // Otherwise blocks get checked as read.
+    block_state = calloc(block_count, sizeof(char));
+    mounted_clean = *sealed_base;
+    if (!mounted_clean && !(flags & STORAGE_READONLY))
+    {
+        for (int i = 0; i < block_count; i++)
+        {
+            checksum_base[i] = block_written(i) ? block_checksum(i) : 0;
+            block_state[i] = CSUM_CHECKED;
+        }
+        image_writeback();
+        image_sync();
+        *sealed_base = 1;
+        image_meta_sync(sealed_base, sizeof(int));
+    }
+
+    cluster_cache = calloc(CLUSTER_CACHE_SIZE, sizeof(cluster_entry));
+    for (int i = 0; i < CLUSTER_CACHE_SIZE; i++)
+    {
+        cluster_cache[i].block = BLOCK_NONE;
+        cluster_cache[i].data  = malloc(CLUSTER_BLOCKS * BLOCK_SIZE);
+    }
+
+    // Set up root directory
+    if (setup)
+    {
+        assert(allocate_inode() == 0);
+        inode* root = get_inode_writable(0);
+        root->mode     = S_IFDIR | 0755;
+        root->uid      = getuid();
+        root->size     = 4;
+        root->gid      = getgid();
+        root->refs     = 2;
+        root->blocks   = 1;
+        root->isdir    = 1;
+        root->block    = allocate_block();
+        clear_block(root->block);
+        root->indirect = -1;
+        stamp_mtime(root);
+
+        for (int i = 0; i < SNAPSHOT_COUNT; i++)
+        {
+            snapshot_base[i].table = BLOCK_NONE;
+        }
+    }
+
+    // Snapshot directory is read only and has nothing on disk
+    snapshot_dir.mode     = S_IFDIR | 0555;
+    snapshot_dir.uid      = getuid();
+    stamp_mtime(&snapshot_dir);
+    snapshot_dir.gid      = getgid();
+    snapshot_dir.refs     = 2;
+    snapshot_dir.isdir    = 1;
+    snapshot_dir.block    = BLOCK_NONE;
+    snapshot_dir.indirect = BLOCK_NONE;
+}
+
+// Get pointer for block of given number
+void*
+get_block_num(int block_num)
+{
+    return image_block(block_num);
+}
+
+// Check a block against its stored checksum without changing any state,
+// so that several threads can check blocks at once
+int
+check_block(int block_num)
+{
+    // Inodes change in place all the time, the table is checked by its
+    // structure instead like the rest of the metadata
+    if (chunk_of_block[block_num] != -1)
+    {
+        return 0;
+    }
+
+    if (block_checksum(block_num) != checksum_base[block_num])
+    {
+        return -EIO;
+    }
+    return 0;
+}
+
+// Get number of blocks in the image
+int
+get_block_count()
+{
+    return block_count;
+}
+
+// Check if checksums were up to date when the image was opened, they are
+// redone from scratch otherwise
+int
+storage_clean()
+{
+    return mounted_clean;
+}
+
+// Get pointer for inode of given number, for reading it
+inode*
+get_inode_num(int inode_num)
+{
+    inode* chunk = get_block_num(chunk_blocks[inode_num / INODES_PER_CHUNK]);
+    return chunk + inode_num % INODES_PER_CHUNK;
+}
+
+// Note that given inode is about to be changed through its pointer, so its
+// chunk gets written back from the cache and sent with the next delta.
+// Inodes outside the live table are left alone.
+void
+inode_changed(inode* inode)
+{
+    int block_num = image_block_of(inode);
+    if (block_num != -1 && chunk_of_block[block_num] != -1)
+    {
+        image_dirty(block_num);
+        mark_changed(block_num);
+    }
+}
+
+// Get pointer for inode of given number, for changing it
+inode*
+get_inode_writable(int inode_num)
+{
+    inode* inode = get_inode_num(inode_num);
+    inode_changed(inode);
+    return inode;
+}
+
+// Get number of given inode from its place in the live inode table, or -1
+// for inodes of a snapshot
+static int
+inode_number(inode* inode)
+{
+    int block_num = image_block_of(inode);
+    int chunk = block_num == -1 ? -1 : chunk_of_block[block_num];
+    if (chunk == -1)
+    {
+        return -1;
+    }
+    return chunk * INODES_PER_CHUNK + (inode - (struct inode*)get_block_num(block_num));
+}
+
+// Get number of the first inode in use at or after given number, or -1
+int
+next_inode(int inode_num)
+{
+    for (int i = inode_num; i < inode_count; i++)
+    {
+        if (!check_inode_free(i))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Check if path points into the snapshot directory
+static int
+in_snapshot_dir(const char* path)
+{
+    int len = strlen(SNAPSHOT_DIR);
+    return strncmp(path, SNAPSHOT_DIR, len) == 0 && (path[len] == 0 || path[len] == '/');
+}
+
+// Find snapshot with the given name
+static snapshot*
+find_snapshot(const char* name, int len)
+{
+    for (int i = 0; i < SNAPSHOT_COUNT; i++)
+    {
+        snapshot* snap = snapshot_base + i;
+        if (snap->table != BLOCK_NONE && strlen(snap->name) == len
+            && strncmp(snap->name, name, len) == 0)
+        {
+            return snap;
+        }
+    }
+    return NULL;
+}
+
+// Get inode of given number from the live table, or from the frozen table
+// of given snapshot
+static inode*
+table_inode(snapshot* snap, int inode_num)
+{
+    if (!snap)
+    {
+        return inode_num >= 0 && inode_num < inode_count ? get_inode_num(inode_num) : NULL;
+    }
+
+    if (inode_num < 0 || inode_num >= snap->blocks * INODES_PER_CHUNK)
+    {
+        return NULL;
+    }
+    inode* chunk = get_block_num(snap->table + inode_num / INODES_PER_CHUNK);
+    return chunk + inode_num % INODES_PER_CHUNK;
+}
+
+// Get inode pointer for given path, walking directories of the live table
+// or that of given snapshot
+static inode*
+lookup_path(snapshot* snap, const char* path)
+{
+    // Split Path by directory delimiters
+    vector* dirs = str_split(path, '/');
+
+    // Start at root directory
+    inode* it = table_inode(snap, 0);
+
+    // Return root directory if asked for
+    if (strcmp("/", path) == 0)
+    {
+        // Clean Up
+        delete_vector(dirs);
+
+        return it;
+    }
+
+    // Loop through path until found
+    for (int path_iter = 0; path_iter < dirs->size; path_iter++)
+    {
+        // Get next directory/filename
+        char* name = vector_get(dirs, path_iter);
+
+        // We are in a directory
+        if (it->isdir)
+        {
+            // Find block containing directory map, unless it's corrupt
+            if (verify_block(it->block) != 0)
+            {
                 // Clean Up
                 delete_vector(dirs);
 
-                return 0;
+                return NULL;
             }
+            map* dirmap = get_block_num(it->block);
+
+            // Get inode number for next directory/filename
+            int inode_num = map_get(dirmap, name);
 
             // Check for Failure
             if (inode_num == -1)
             {
-                return -ENOENT;
+                // Clean Up
+                delete_vector(dirs);
+
+                return NULL;
             }
 
-            // Move to next directory
-            it = get_inode_num(inode_num);
+            // Move to next directory
+            it = table_inode(snap, inode_num);
+            if (!it)
+            {
+                // Clean Up
+                delete_vector(dirs);
+
+                return NULL;
+            }
+        }
+
+    }
+
+    // Clean Up
+    delete_vector(dirs);
+
+    // Return where we got out of iteration loop
+    return it;
+}
+
+// Get inode pointer for given path, paths into the snapshot directory
+// resolve in the frozen inode table of that snapshot
+inode*
+get_inode(const char* path)
+{
+    if (!in_snapshot_dir(path))
+    {
+        return lookup_path(NULL, path);
+    }
+
+    // The snapshot directory itself
+    const char* name = path + strlen(SNAPSHOT_DIR);
+    if (*name == 0)
+    {
+        return &snapshot_dir;
+    }
+    name++;
+
+    // Split off name of snapshot
+    const char* rest = strchr(name, '/');
+    snapshot* snap = find_snapshot(name, rest ? rest - name : strlen(name));
+    if (!snap)
+    {
+        return NULL;
+    }
+
+    return lookup_path(snap, rest ? rest : "/");
+}
+
+// Get inode of given number from the inode table dir lives in
+inode*
+get_entry_inode(inode* dir, int inode_num)
+{
+    if (inode_number(dir) != -1)
+    {
+        return table_inode(NULL, inode_num);
+    }
+
+    int block_num = image_block_of(dir);
+    for (int i = 0; i < SNAPSHOT_COUNT; i++)
+    {
+        snapshot* snap = snapshot_base + i;
+        if (snap->table == BLOCK_NONE)
+        {
+            continue;
+        }
+
+        if (block_num >= snap->table && block_num < snap->table + snap->blocks)
+        {
+            return table_inode(snap, inode_num);
+        }
+    }
+
+    return NULL;
+}
+
+// Get map of given directory for changing it, copying the block first if
+// a snapshot shares it. The directory inode counts as changed too.
+static map*
+get_dir_map_writable(inode* dir)
+{
+    inode_changed(dir);
+    if (copy_shared_block(&dir->block, dir->block) != 0)
+    {
+        return NULL;
+    }
+    return get_block_writable(dir->block);
+}
+
+// Make an inode at the given path and return its number
+int
+make_inode(const char* path, mode_t mode)
+{
+    int inode_num = -1;
+
+    // Snapshots are read only
+    if (in_snapshot_dir(path))
+    {
+        return -EROFS;
+    }
+
+    // Split Path by directory delimiters
+    vector* dirs = str_split(path, '/');
+
+    // Start at root directory
+    inode* it = get_inode_num(0);
+
+    // Loop through path until found
+    for (int path_iter = 0; path_iter < dirs->size; path_iter++)
+    {
+        // Get next directory/filename
+        char* name = vector_get(dirs, path_iter);
+
+        // We are in a directory
+        if (it->isdir)
+        {
+            // Find block containing directory map
+            map* dirmap = get_block_num(it->block);
+
+            // Get inode number for next directory/filename
+            int inode_num = map_get(dirmap, name);
+
+            // Last piece of path
+            if (path_iter == dirs->size - 1)
+            {
+                // Already Exists
+                if (inode_num != -1)
+                {
+                    // Clean Up
+                    delete_vector(dirs);
+
+                    return -EEXIST;
+                }
+
+                // Copy directory away from snapshots before changing it
+                dirmap = get_dir_map_writable(it);
+                if (!dirmap)
+                {
+                    // Clean Up
+                    delete_vector(dirs);
+
+                    return -ENOSPC;
+                }
+
+                // Make node
+                inode_num = allocate_inode();
+
+                if (inode_num == -1)
+                {
+                    // Clean Up
+                    delete_vector(dirs);
+
+                    return -EDQUOT;
+                }
+
+                inode* inode = get_inode_writable(inode_num);
+                inode->mode  = mode;
+                inode->uid   = getuid();
+                inode->size  = S_ISDIR(mode) ? 4 : 0;
+                stamp_mtime(inode);
+                inode->gid   = getgid();
+                inode->refs  = S_ISDIR(mode) ? 2 : 1;
+                inode->isdir = S_ISDIR(mode);
+                inode->flags = it->flags & INODE_COMPRESSED;
+                inode->block = BLOCK_NONE;
+                inode->indirect = BLOCK_NONE;
+                inode->blocks = 0;
+
+                // Directories need a block for their map, files allocate on write
+                if (inode->isdir)
+                {
+                    inode->block = allocate_block();
+
+                    if (inode->block == BLOCK_NONE)
+                    {
+                        // Clean Up
+                        free_inode(inode_num);
+                        delete_vector(dirs);
+
+                        return -EDQUOT;
+                    }
+
+                    clear_block(inode->block);
+                    inode->blocks = 1;
+                }
+
+                int rv = map_add(dirmap, name, inode_num);
+                if (rv != 0)
+                {
+                    // Clean Up
+                    if (inode->isdir)
+                    {
+                        free_block(inode->block);
+                    }
+                    free_inode(inode_num);
+                    delete_vector(dirs);
+
+                    return rv;
+                }
+
+                // Subdirectories link back to it with ".."
+                if (inode->isdir)
+                {
+                    it->refs++;
+                }
+                
+                // Clean Up
+                delete_vector(dirs);
+
+                return 0;
+            }
+
+            // Check for Failure
+            if (inode_num == -1)
+            {
+                // Clean Up
+                delete_vector(dirs);
+
+                return -ENOENT;
+            }
+
+            // Move to next directory
+            it = get_inode_num(inode_num);
+        }
+        else
+        {
+            // Clean Up
+            delete_vector(dirs);
+
+            return -ENOTDIR;
+        }
+
+    }
+
+    // Clean Up
+    delete_vector(dirs);
+
+    // Return inode number
+    return inode_num;
+}
+
+// Find the live directory holding the last name of a split path
+static int
+lookup_parent(vector* dirs, inode** parent)
+{
+    // Start at root directory
+    inode* it = get_inode_num(0);
+
+    // Walk every name but the last
+    for (int path_iter = 0; path_iter < dirs->size - 1; path_iter++)
+    {
+        if (!it->isdir)
+        {
+            return -ENOTDIR;
+        }
+
+        if (verify_block(it->block) != 0)
+        {
+            return -EIO;
+        }
+
+        int inode_num = map_get(get_block_num(it->block), vector_get(dirs, path_iter));
+        if (inode_num == -1)
+        {
+            return -ENOENT;
+        }
+
+        it = get_inode_num(inode_num);
+    }
+
+    if (!it->isdir)
+    {
+        return -ENOTDIR;
+    }
+
+    if (verify_block(it->block) != 0)
+    {
+        return -EIO;
+    }
+
+    *parent = it;
+    return 0;
+}
+
+// Drop a name of given inode from dir, deleting the inode with its last
+// name. Directories have one name and are empty by now.
+static void
+drop_link(inode* dir, int inode_num)
+{
+    inode* node = get_inode_writable(inode_num);
+    inode_changed(dir);
+
+    if (node->isdir)
+    {
+        // Its ".." goes with it
+        dir->refs--;
+        free_block(node->block);
+        free_inode(inode_num);
+        return;
+    }
+
+    node->refs--;
+    if (!node->refs)
+    {
+        truncate_inode(node, 0);
+        free_inode(inode_num);
+    }
+}
+
+// Check if given directory inode has no entries
+static int
+dir_empty(inode* dir)
+{
+    if (verify_block(dir->block) != 0)
+    {
+        return 0;
+    }
+    return ((map*)get_block_num(dir->block))->size == 0;
+}
+
+// Unlink the given path from its inode and delete the inode if necessary
+int
+unlink_inode(const char* path, int directory)
+{
+    // Snapshots are read only
+    if (in_snapshot_dir(path))
+    {
+        return -EROFS;
+    }
+
+    // Split Path by directory delimiters
+    vector* dirs = str_split(path, '/');
+
+    // Root has no name to remove
+    inode* dir;
+    int rv = dirs->size ? lookup_parent(dirs, &dir) : -EBUSY;
+    if (rv != 0)
+    {
+        // Clean Up
+        delete_vector(dirs);
+
+        return rv;
+    }
+
+    char* name = vector_get(dirs, dirs->size - 1);
+    int inode_num = map_get(get_block_num(dir->block), name);
+
+    if (inode_num == -1)
+    {
+        rv = -ENOENT;
+    }
+    else if (get_inode_num(inode_num)->isdir && !directory)
+    {
+        rv = -EISDIR;
+    }
+    else if (!get_inode_num(inode_num)->isdir && directory)
+    {
+        rv = -ENOTDIR;
+    }
+    else if (directory && !dir_empty(get_inode_num(inode_num)))
+    {
+        rv = -ENOTEMPTY;
+    }
+    else
+    {
+        // Copy directory away from snapshots before changing it
+        map* dirmap = get_dir_map_writable(dir);
+        if (!dirmap)
+        {
+            rv = -ENOSPC;
+        }
+        else
+        {
+            map_remove(dirmap, name);
+            drop_link(dir, inode_num);
+        }
+    }
+
+    // Clean Up
+    delete_vector(dirs);
+
+    return rv;
+}
+
+// Create a hard link from given path to new one
+int
+link_inode(const char* path, const char* new)
+{
+    // Snapshots are read only and have inode tables of their own
+    if (in_snapshot_dir(new))
+    {
+        return -EROFS;
+    }
+
+    if (in_snapshot_dir(path))
+    {
+        return -EXDEV;
+    }
+
+    inode* node = get_inode(path);
+    if (!node)
+    {
+        return -ENOENT;
+    }
+
+    // Directories have exactly one name
+    if (node->isdir)
+    {
+        return -EPERM;
+    }
+
+    // Split Path by directory delimiters
+    vector* dirs = str_split(new, '/');
+
+    inode* dir;
+    int rv = dirs->size ? lookup_parent(dirs, &dir) : -EEXIST;
+    if (rv != 0)
+    {
+        // Clean Up
+        delete_vector(dirs);
+
+        return rv;
+    }
+
+    char* name = vector_get(dirs, dirs->size - 1);
+
+    if (map_get(get_block_num(dir->block), name) != -1)
+    {
+        rv = -EEXIST;
+    }
+    else
+    {
+        // Copy directory away from snapshots before changing it
+        map* dirmap = get_dir_map_writable(dir);
+        rv = dirmap ? map_add(dirmap, name, inode_number(node)) : -ENOSPC;
+        if (rv == 0)
+        {
+            inode_changed(node);
+            node->refs++;
+        }
+    }
+
+    // Clean Up
+    delete_vector(dirs);
+
+    return rv;
+}
+
+// Move the name at one split path to another, replacing what the other
+// named. Both parents are looked up once and the entry moves in one step.
+static int
+move_entry(vector* from, vector* to)
+{
+    // Root can't move, nor be replaced
+    if (!from->size || !to->size)
+    {
+        return -EBUSY;
+    }
+
+    inode* from_dir;
+    inode* to_dir;
+    int rv = lookup_parent(from, &from_dir);
+    if (rv != 0)
+    {
+        return rv;
+    }
+
+    rv = lookup_parent(to, &to_dir);
+    if (rv != 0)
+    {
+        return rv;
+    }
+
+    char* from_name = vector_get(from, from->size - 1);
+    char* to_name   = vector_get(to, to->size - 1);
+
+    int inode_num = map_get(get_block_num(from_dir->block), from_name);
+    if (inode_num == -1)
+    {
+        return -ENOENT;
+    }
+    inode* node = get_inode_num(inode_num);
+
+    // Target, if any, must be replaceable by what moves there
+    int old_num = map_get(get_block_num(to_dir->block), to_name);
+    if (old_num == inode_num)
+    {
+        // Two names of one file, nothing to do
+        return 0;
+    }
+
+    if (old_num != -1)
+    {
+        inode* old = get_inode_num(old_num);
+        if (node->isdir && !old->isdir)
+        {
+            return -ENOTDIR;
+        }
+
+        if (!node->isdir && old->isdir)
+        {
+            return -EISDIR;
+        }
+
+        if (old->isdir && !dir_empty(old))
+        {
+            return -ENOTEMPTY;
+        }
+    }
+
+    // Copy both directories away from snapshots before changing either
+    map* from_map = get_dir_map_writable(from_dir);
+    map* to_map   = get_dir_map_writable(to_dir);
+    if (!from_map || !to_map)
+    {
+        return -ENOSPC;
+    }
+
+    // An existing target is pointed at the inode in place, so the name
+    // never goes missing
+    if (old_num != -1)
+    {
+        map_set(to_map, to_name, inode_num);
+    }
+    else
+    {
+        rv = map_add(to_map, to_name, inode_num);
+        if (rv != 0)
+        {
+            return rv;
+        }
+    }
+    map_remove(from_map, from_name);
+
+    // A directory's ".." now links its new parent
+    if (node->isdir && from_dir != to_dir)
+    {
+        from_dir->refs--;
+        to_dir->refs++;
+    }
+
+    if (old_num != -1)
+    {
+        drop_link(to_dir, old_num);
+    }
+
+    return 0;
+}
+
+// Rename given path to new one, replacing what new names
+int
+rename_inode(const char* path, const char* new)
+{
+    // Snapshots are read only
+    if (in_snapshot_dir(path) || in_snapshot_dir(new))
+    {
+        return -EROFS;
+    }
+
+    // A directory can't move inside itself
+    int len = strlen(path);
+    if (strncmp(path, new, len) == 0 && new[len] == '/')
+    {
+        return -EINVAL;
+    }
+
+    // Split Paths by directory delimiters
+    vector* from = str_split(path, '/');
+    vector* to   = str_split(new, '/');
+
+    int rv = move_entry(from, to);
+
+    // Clean Up
+    delete_vector(from);
+    delete_vector(to);
+
+    return rv;
+}
+
+// Get filesystem info from the free counts, without scanning anything
+int
+get_statfs(struct statvfs* st)
+{
+    memset(st, 0, sizeof(struct statvfs));
+
+    // Blocks promised to pending writes are as good as used
+    int available = free_block_count - reserved_blocks;
+
+    // Inodes the table can still grow by, a chunk per free block along
+    // with the blocks listing them
+    long growable = (long)available * CHUNKS_PER_LIST / (CHUNKS_PER_LIST + 1) * INODES_PER_CHUNK;
+
+    st->f_bsize   = BLOCK_SIZE;
+    st->f_frsize  = BLOCK_SIZE;
+    st->f_blocks  = block_count;
+    st->f_bfree   = available;
+    st->f_bavail  = available;
+    st->f_files   = inode_count + growable;
+    st->f_ffree   = free_inode_count + growable;
+    st->f_favail  = free_inode_count + growable;
+    st->f_namemax = MAP_NAME_MAX;
+    return 0;
+}
+
+// Get inode info for given path
+int
+get_stat(inode* inode, struct stat* st)
+{
+    // Clear stat structure
+    memset(st, 0, sizeof(struct stat));
+
+    // Assign values
+    st->st_mode    = inode->mode;
+    st->st_nlink   = inode->refs;
+    st->st_uid     = inode->uid;
+    st->st_gid     = inode->gid;
+    st->st_size    = inode->size;
+    st->st_blocks  = (blkcnt_t)inode->blocks * (BLOCK_SIZE / 512); // Counted in 512 byte units
+    st->st_blksize = BLOCK_SIZE;
+    st->st_mtim.tv_sec = inode->mtime;
+    st->st_mtim.tv_nsec = inode->mtime_nsec;
+
+    // Success
+    return 0;
+}
+
+// Check if given inode belongs to a snapshot and can't be changed
+int
+inode_read_only(inode* inode)
+{
+    return inode_number(inode) == -1;
+}
+
+// Get in-memory data waiting for a block for given file block, if any
+static void*
+get_pending(inode* inode, int index)
+{
+    int inode_num = inode_number(inode);
+    delalloc* da = inode_num == -1 ? NULL : pending[inode_num];
+    return da ? da->pages[index] : NULL;
+}
+
+// Hold data for given file block in memory, reserving a block for flush.
+// The caller fills bytes start to end, only the rest gets zeroed.
+static void*
+add_pending(inode* inode, int index, int start, int end)
+{
+    int inode_num = inode_number(inode);
+    delalloc* da = pending[inode_num];
+
+    // Blocks past the first need an indirect block mapping them
+    int indirect = index > 0 && inode->indirect == BLOCK_NONE && !(da && da->indirect);
+
+    // Make sure flush can't run out of space
+    if (free_block_count - reserved_blocks < 1 + indirect)
+    {
+        return NULL;
+    }
+
+    if (!da)
+    {
+        da = pending[inode_num] = calloc(1, sizeof(delalloc));
+    }
+
+    void* page = malloc(BLOCK_SIZE);
+    memset(page, 0, start);
+    memset(page + end, 0, BLOCK_SIZE - end);
+
+    da->pages[index] = page;
+    da->count++;
+    da->indirect += indirect;
+    reserved_blocks += 1 + indirect;
+
+    return da->pages[index];
+}
+
+// Throw away in-memory data for given file block and its reservation
+static void
+drop_pending(inode* inode, int index)
+{
+    int inode_num = inode_number(inode);
+    delalloc* da = inode_num == -1 ? NULL : pending[inode_num];
+
+    if (!da || !da->pages[index])
+    {
+        return;
+    }
+
+    free(da->pages[index]);
+    da->pages[index] = NULL;
+    da->count--;
+    reserved_blocks--;
+
+    if (!da->count)
+    {
+        reserved_blocks -= da->indirect;
+        free(da);
+        pending[inode_num] = NULL;
+    }
+}
+
+// Pick where given file block should go: right after the nearest mapped
+// block before it, or after the indirect block for a fresh file
+static int
+allocation_goal(inode* inode, int index)
+{
+    for (int i = index - 1; i >= 0 && i >= index - 16; i--)
+    {
+        int* slot = get_block_slot(inode, i, 0);
+        if (slot && block_mapped(*slot))
+        {
+            return *slot + index - i;
+        }
+    }
+
+    if (inode->indirect != BLOCK_NONE)
+    {
+        return inode->indirect + 1;
+    }
+
+    return 0;
+}
+
+// Give a file its indirect block at the start of a free run long enough
+// for count data blocks after it, which are left free for the caller
+static int
+place_indirect(inode* inode, int count)
+{
+    if (free_block_count - reserved_blocks < 1)
+    {
+        return -ENOSPC;
+    }
+
+    int len;
+    int start = find_run(allocation_goal(inode, 1), count + 1, &len);
+    claim_block(start);
+    inode->indirect = start;
+    memset(get_block_writable(start), 0xff, BLOCK_SIZE);
+
+    return 0;
+}
+
+// Give file block its own copy of a block shared with other files
+static int
+unshare_block(inode* inode, int index, int* slot)
+{
+    return copy_shared_block(slot, allocation_goal(inode, index));
+}
+
+// Check if given cluster of a file is stored compressed, the last slot of
+// a compressed cluster is always past its data
+static int
+cluster_compressed(inode* inode, int cluster)
+{
+    int last = (cluster + 1) * CLUSTER_BLOCKS - 1;
+    if (last > INDIRECT_COUNT)
+    {
+        return 0;
+    }
+
+    int* slot = get_block_slot(inode, last, 0);
+    return slot && *slot == BLOCK_COMPRESSED;
+}
+
+// Get decompressed data of given compressed cluster, or NULL if it is
+// corrupt. Compressed data starts with its length.
+static void*
+read_cluster(inode* inode, int cluster)
+{
+    int first = cluster * CLUSTER_BLOCKS;
+    int block_num = *get_block_slot(inode, first, 0);
+
+    // Look in cache, remembering least recently used entry
+    cluster_entry* victim = cluster_cache;
+    for (int i = 0; i < CLUSTER_CACHE_SIZE; i++)
+    {
+        cluster_entry* e = cluster_cache + i;
+        if (e->block == block_num)
+        {
+            e->used = ++cluster_clock;
+            return e->data;
+        }
+
+        if (e->used < victim->used)
+        {
+            victim = e;
+        }
+    }
+
+    // Gather compressed data
+    char stream[CLUSTER_BLOCKS * BLOCK_SIZE];
+    int count = 0;
+    while (count < CLUSTER_BLOCKS)
+    {
+        int* slot = get_block_slot(inode, first + count, 0);
+        if (!block_mapped(*slot))
+        {
+            break;
+        }
+        if (verify_block(*slot) != 0)
+        {
+            return NULL;
+        }
+        memcpy(stream + count * BLOCK_SIZE, get_block_num(*slot), BLOCK_SIZE);
+        count++;
+    }
+
+    int length = *(int*)stream;
+    victim->block = BLOCK_NONE;
+    if (length < 0 || length > count * BLOCK_SIZE - sizeof(int))
+    {
+        return NULL;
+    }
+
+    int size = CLUSTER_BLOCKS * BLOCK_SIZE;
+    if (lz_decompress(stream + sizeof(int), length, victim->data, size) != size)
+    {
+        return NULL;
+    }
+
+    victim->block = block_num;
+    victim->used  = ++cluster_clock;
+    return victim->data;
+}
+
+// Turn a compressed cluster back into pending blocks so it can be changed,
+// it gets compressed again on flush
+static int
+expand_cluster(inode* inode, int cluster)
+{
+    int first = cluster * CLUSTER_BLOCKS;
+    int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int in_file = end - first < CLUSTER_BLOCKS ? end - first : CLUSTER_BLOCKS;
+
+    // Keep a copy, cache entry goes away with the blocks
+    char data[CLUSTER_BLOCKS * BLOCK_SIZE];
+    void* cached = read_cluster(inode, cluster);
+    if (!cached)
+    {
+        return -EIO;
+    }
+    memcpy(data, cached, sizeof(data));
+
+    if (!get_block_slot(inode, first + CLUSTER_BLOCKS - 1, 1))
+    {
+        return -ENOSPC;
+    }
+
+    // Make sure pending blocks fit once compressed ones are gone
+    int freed = 0;
+    for (int j = 0; j < CLUSTER_BLOCKS; j++)
+    {
+        int* slot = get_block_slot(inode, first + j, 0);
+        freed += block_mapped(*slot) && !check_block_shared(*slot);
+    }
+
+    if (in_file > free_block_count - reserved_blocks + freed)
+    {
+        return -ENOSPC;
+    }
+
+    for (int j = 0; j < CLUSTER_BLOCKS; j++)
+    {
+        int* slot = get_block_slot(inode, first + j, 1);
+        if (block_mapped(*slot))
+        {
+            free_block(*slot);
+            inode->blocks--;
+        }
+        *slot = BLOCK_NONE;
+    }
+
+    for (int j = 0; j < in_file; j++)
+    {
+        memcpy(add_pending(inode, first + j, 0, BLOCK_SIZE), data + j * BLOCK_SIZE, BLOCK_SIZE);
+    }
+
+    return 0;
+}
+
+// Compress every cluster of given inode with pending data that shrinks by
+// at least a block, flush writes the rest out as is
+static int
+compress_pending(inode* inode)
+{
+    int inode_num = inode_number(inode);
+    int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (int first = 0; first < end && first + CLUSTER_BLOCKS - 1 <= INDIRECT_COUNT;
+         first += CLUSTER_BLOCKS)
+    {
+        delalloc* da = pending[inode_num];
+        if (!da)
+        {
+            return 0;
+        }
+
+        // Only clusters with pending data that could shrink
+        int waiting = 0;
+        for (int j = 0; j < CLUSTER_BLOCKS; j++)
+        {
+            waiting += da->pages[first + j] != NULL;
+        }
+
+        int in_file = end - first < CLUSTER_BLOCKS ? end - first : CLUSTER_BLOCKS;
+        if (!waiting || in_file < 2)
+        {
+            continue;
+        }
+
+        // Gather cluster from pending data, blocks and holes
+        char data[CLUSTER_BLOCKS * BLOCK_SIZE];
+        for (int j = 0; j < CLUSTER_BLOCKS; j++)
+        {
+            int* slot = get_block_slot(inode, first + j, 0);
+            void* dest = data + j * BLOCK_SIZE;
+            if (da->pages[first + j])
+            {
+                memcpy(dest, da->pages[first + j], BLOCK_SIZE);
+            }
+            else if (slot && block_mapped(*slot))
+            {
+                memcpy(dest, get_block_num(*slot), BLOCK_SIZE);
+            }
+            else
+            {
+                memset(dest, 0, BLOCK_SIZE);
+            }
+        }
+
+        char stream[CLUSTER_BLOCKS * BLOCK_SIZE];
+        memset(stream, 0, sizeof(stream));
+        int length = lz_compress(data, sizeof(data), stream + sizeof(int),
+                                 (in_file - 1) * BLOCK_SIZE - sizeof(int));
+        if (!length)
+        {
+            continue;
+        }
+        *(int*)stream = length;
+
+        // Make sure blocks are there before anything changes
+        int count = (length + sizeof(int) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (count > free_block_count - reserved_blocks + waiting)
+        {
+            continue;
+        }
+
+        if (!get_block_slot(inode, first + CLUSTER_BLOCKS - 1, 1))
+        {
+            return -ENOSPC;
+        }
+
+        // Out with the old data
+        for (int j = 0; j < CLUSTER_BLOCKS; j++)
+        {
+            int* slot = get_block_slot(inode, first + j, 1);
+            if (block_mapped(*slot))
+            {
+                free_block(*slot);
+                inode->blocks--;
+            }
+            *slot = BLOCK_NONE;
+            drop_pending(inode, first + j);
+        }
+
+        // Store compressed data, marking the slots past it
+        int goal = allocation_goal(inode, first);
+        int j = 0;
+        while (j < count)
+        {
+            int len;
+            int start = allocate_run(goal, count - j, &len);
+            for (int k = 0; k < len; k++, j++)
+            {
+                *get_block_slot(inode, first + j, 1) = start + k;
+                memcpy(get_block_writable(start + k), stream + j * BLOCK_SIZE, BLOCK_SIZE);
+                inode->blocks++;
+            }
+            goal = start + len;
+        }
+
+        for (; j < CLUSTER_BLOCKS; j++)
+        {
+            *get_block_slot(inode, first + j, 1) = BLOCK_COMPRESSED;
+        }
+    }
+
+    return 0;
+}
+
+// Give blocks to all pending data of given inode, in as few contiguous
+// runs as free space allows
+static int
+flush_pending(inode* inode)
+{
+    int inode_num = inode_number(inode);
+    delalloc* da = inode_num == -1 ? NULL : pending[inode_num];
+
+    if (!da)
+    {
+        return 0;
+    }
+
+    inode_changed(inode);
+
+    // Place the indirect block where the data run is going to start, so
+    // it doesn't split the run, and leave the blocks after it free for
+    // the data. A shared one gets its private copy here.
+    int mapped = da->count > (da->pages[0] != NULL);
+    if (da->indirect)
+    {
+        da->indirect = 0;
+        reserved_blocks--;
+    }
+    if (mapped && inode->indirect == BLOCK_NONE && place_indirect(inode, da->count) != 0)
+    {
+        return -ENOSPC;
+    }
+    if (mapped && !get_block_slot(inode, 1, 1))
+    {
+        return -ENOSPC;
+    }
+
+    // Compressed files write out what they can compressed first
+    if (inode->flags & INODE_COMPRESSED)
+    {
+        int rv = compress_pending(inode);
+        if (rv)
+        {
+            return rv;
+        }
+
+        da = pending[inode_num];
+        if (!da)
+        {
+            return 0;
+        }
+    }
+
+    // Share blocks that already hold the same data instead of writing copies
+    unsigned long hashes[1 + 4096 / 4];
+    if (dedup_enabled)
+    {
+        for (int i = 0; i <= INDIRECT_COUNT && pending[inode_num]; i++)
+        {
+            void* page = pending[inode_num]->pages[i];
+            if (!page)
+            {
+                continue;
+            }
+
+            hashes[i] = hash_block(page);
+            int block_num = dedup_find(page, hashes[i]);
+            if (block_num == BLOCK_NONE)
+            {
+                continue;
+            }
+
+            add_ref(block_num);
+            *get_block_slot(inode, i, 1) = block_num;
+            inode->blocks++;
+            drop_pending(inode, i);
+        }
+
+        da = pending[inode_num];
+        if (!da)
+        {
+            return 0;
+        }
+    }
+
+    int index = 0;
+    while (da->count)
+    {
+        // Find next pending block
+        while (!da->pages[index])
+        {
+            index++;
+        }
+
+        int len;
+        int start = allocate_run(allocation_goal(inode, index), da->count, &len);
+        if (len == 0)
+        {
+            return -ENOSPC;
+        }
+
+        // Hand the run out to pending blocks in file order
+        for (int j = 0; j < len; index++)
+        {
+            if (!da->pages[index])
+            {
+                continue;
+            }
+
+            int* slot = get_block_slot(inode, index, 1);
+            *slot = start + j++;
+            memcpy(get_block_writable(*slot), da->pages[index], BLOCK_SIZE);
+            inode->blocks++;
+            if (dedup_enabled)
+            {
+                dedup_add(*slot, hashes[index]);
+            }
+
+            free(da->pages[index]);
+            da->pages[index] = NULL;
+            da->count--;
+            reserved_blocks--;
+        }
+    }
+
+    free(da);
+    pending[inode_num] = NULL;
+
+    return 0;
+}
+
+// Write out pending data of given inode. Checksums are brought up to
+// date by the next sync, sealing syncs the whole image so a close
+// doesn't do it.
+int
+flush_inode(inode* inode)
+{
+    return flush_pending(inode);
+}
+
+// Write out pending data of given inode and seal checksums, for fsync
+int
+sync_inode(inode* inode)
+{
+    int rv = flush_pending(inode);
+    seal_checksums();
+    return rv;
+}
+
+// Write a memory-only image out to its file if it is kept across mounts,
+// called at unmount after storage_flush. Only blocks in use are saved.
+void
+storage_save()
+{
+    if (!save_on_close)
+    {
+        return;
+    }
+
+    char* used = malloc(block_count);
+    for (int i = 0; i < block_count; i++)
+    {
+        used[i] = !check_block_free(i);
+
+        // Free blocks are left as holes, so they are zeros again
+        if (!used[i])
+        {
+            written_base[i / 8] &= ~(1 << i % 8);
+            checksum_base[i] = 0;
+            mark_changed(i);
+        }
+    }
+
+    image_save(used);
+    free(used);
+}
+
+// Flush pending data of every inode and seal checksums
+void
+storage_flush()
+{
+    int mark = image_pins();
+    for (int i = 0; i < inode_count; i++)
+    {
+        if (pending[i])
+        {
+            flush_pending(get_inode_num(i));
+            image_unpin(mark);
+        }
+    }
+    seal_checksums();
+}
+
+// Turn on deduplication of flushed data, indexing every plain data block
+// of the live files already in the image
+void
+storage_dedup()
+{
+    dedup_buckets = malloc(DEDUP_BUCKETS * sizeof(int));
+    for (int i = 0; i < DEDUP_BUCKETS; i++)
+    {
+        dedup_buckets[i] = BLOCK_NONE;
+    }
+    dedup_index = calloc(block_count, sizeof(dedup_entry));
+    dedup_enabled = 1;
+
+    int mark = image_pins();
+    for (int i = next_inode(0); i != -1; i = next_inode(i + 1))
+    {
+        inode* inode = get_inode_num(i);
+        if (inode->isdir)
+        {
+            continue;
+        }
+
+        int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (int index = 0; index < end; index++)
+        {
+            int* slot = get_block_slot(inode, index, 0);
+            if (slot && block_mapped(*slot)
+                && !cluster_compressed(inode, index / CLUSTER_BLOCKS))
+            {
+                dedup_add(*slot, hash_block(get_block_num(*slot)));
+            }
+        }
+        image_unpin(mark);
+    }
+}
+
+// Give the kernel advice about the pages backing file blocks in
+// [first, last), one call per physically contiguous run
+static void
+advise_blocks(inode* inode, int first, int last, int advice)
+{
+    int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (last > end)
+    {
+        last = end;
+    }
+
+    int run_start = BLOCK_NONE;
+    int run_len = 0;
+    for (int index = first; index <= last; index++)
+    {
+        int* slot = index < last ? get_block_slot(inode, index, 0) : NULL;
+        int block_num = slot ? *slot : BLOCK_NONE;
+
+        if (block_mapped(block_num) && block_num == run_start + run_len)
+        {
+            run_len++;
+            continue;
+        }
+
+        if (run_len)
+        {
+            image_advise(run_start, run_len, advice);
+        }
+
+        run_start = block_num;
+        run_len = block_mapped(block_num);
+    }
+}
+
+// Track how a file is being read. Blocks ahead of a sequential reader are
+// asked for before it gets there, in a window that doubles as the streak
+// goes on, and files read out of order get no readahead at all.
+static void
+advise_read(inode* inode, off_t offset, size_t size)
+{
+    int inode_num = inode_number(inode);
+    if (inode_num == -1)
+    {
+        return;
+    }
+
+    access_pattern* ap = patterns + inode_num;
+    int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (offset == ap->next)
+    {
+        if (ap->streak <= -RANDOM_READS)
+        {
+            advise_blocks(inode, 0, end, MADV_NORMAL);
+        }
+        ap->streak = ap->streak < 0 ? 1 : ap->streak + 1;
+
+        if (ap->streak == SEQUENTIAL_READS)
+        {
+            advise_blocks(inode, 0, end, MADV_SEQUENTIAL);
+        }
+    }
+    else
+    {
+        if (ap->streak >= SEQUENTIAL_READS)
+        {
+            advise_blocks(inode, 0, end, MADV_NORMAL);
+        }
+        ap->streak = ap->streak > 0 ? -1 : ap->streak - 1;
+        ap->window = 0;
+        ap->ahead  = 0;
+
+        if (ap->streak == -RANDOM_READS)
+        {
+            advise_blocks(inode, 0, end, MADV_RANDOM);
+        }
+    }
+    ap->next = offset + size;
+
+    // Move the window on once the reader is halfway into it
+    int last = (offset + size - 1) / BLOCK_SIZE;
+    if (ap->streak >= SEQUENTIAL_READS && last + ap->window / 2 >= ap->ahead)
+    {
+        ap->window = ap->window ? ap->window * 2 : READAHEAD_MIN;
+        if (ap->window > READAHEAD_MAX)
+        {
+            ap->window = READAHEAD_MAX;
+        }
+
+        int first = ap->ahead > last ? ap->ahead : last + 1;
+        ap->ahead = last + 1 + ap->window;
+        advise_blocks(inode, first, ap->ahead, MADV_WILLNEED);
+    }
+}
+
+// Read data from given inode into buffer, holes read back as zeros
+int
+read_data(inode* inode, void* buf, size_t size, off_t offset)
+{
+    // Nothing past end of file
+    if (offset >= inode->size)
+    {
+        return 0;
+    }
+
+    if (size > inode->size - offset)
+    {
+        size = inode->size - offset;
+    }
+
+    // Block numbers come from the indirect block, make sure it's sound
+    if (inode->indirect != BLOCK_NONE && verify_block(inode->indirect) != 0)
+    {
+        return -EIO;
+    }
+
+    advise_read(inode, offset, size);
+
+    // Loop through blocks covering the range, done with each as it's copied
+    void* data_iter = buf;
+    size_t size_remaining = size;
+    int mark = image_pins();
+    while (size_remaining > 0)
+    {
+        int index = offset / BLOCK_SIZE;
+        int block_offset = offset % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > size_remaining)
+        {
+            chunk = size_remaining;
+        }
+
+        // Copy from compressed cluster, block, pending data or fill hole
+        int* slot = get_block_slot(inode, index, 0);
+        void* page = get_pending(inode, index);
+        if (cluster_compressed(inode, index / CLUSTER_BLOCKS))
+        {
+            void* data = read_cluster(inode, index / CLUSTER_BLOCKS);
+            if (!data)
+            {
+                return -EIO;
+            }
+            memcpy(data_iter, data + (index % CLUSTER_BLOCKS) * BLOCK_SIZE + block_offset, chunk);
+        }
+        else if (slot && block_mapped(*slot))
+        {
+            if (verify_block(*slot) != 0)
+            {
+                return -EIO;
+            }
+            memcpy(data_iter, get_block_num(*slot) + block_offset, chunk);
+        }
+        else if (page)
+        {
+            memcpy(data_iter, page + block_offset, chunk);
+        }
+        else
+        {
+            memset(data_iter, 0, chunk);
+        }
+        image_unpin(mark);
+
+        size_remaining -= chunk;
+        data_iter += chunk;
+        offset += chunk;
+    }
+
+    return size;
+}
+
+// Write data into given inode, data landing in holes waits in memory for
+// flush to give it blocks
+int
+write_data(inode* inode, const void* buf, size_t size, off_t offset)
+{
+    if (inode_read_only(inode))
+    {
+        return -EROFS;
+    }
+
+    // Check against largest possible file
+    if (offset + size > MAX_FILE_SIZE)
+    {
+        return -EFBIG;
+    }
+
+    inode_changed(inode);
+
+    if (inode->indirect != BLOCK_NONE && verify_block(inode->indirect) != 0)
+    {
+        return -EIO;
+    }
+
+    // Loop through blocks covering the range, done with each as it's copied
+    const void* data_iter = buf;
+    size_t size_remaining = size;
+    int mark = image_pins();
+    while (size_remaining > 0)
+    {
+        int index = offset / BLOCK_SIZE;
+        int block_offset = offset % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > size_remaining)
+        {
+            chunk = size_remaining;
+        }
+
+        // Compressed data has to be taken apart to change it
+        int rv = 0;
+        if (cluster_compressed(inode, index / CLUSTER_BLOCKS))
+        {
+            rv = expand_cluster(inode, index / CLUSTER_BLOCKS);
+        }
+
+        // Write in place if mapped, otherwise hold it in memory. Holes
+        // get their block map on flush.
+        int* slot = rv ? NULL : get_block_slot(inode, index, 0);
+        void* dest = NULL;
+        if (slot && block_mapped(*slot))
+        {
+            // Don't build on corrupt data
+            rv = verify_block(*slot);
+            slot = rv ? NULL : get_block_slot(inode, index, 1);
+            if (slot && unshare_block(inode, index, slot) == 0)
+            {
+                dedup_forget(*slot);
+                dest = get_block_writable(*slot);
+            }
+        }
+        else if (rv == 0)
+        {
+            dest = get_pending(inode, index);
+            if (!dest)
+            {
+                dest = add_pending(inode, index, block_offset, block_offset + chunk);
+            }
+        }
+
+        // Out of space, report what made it in
+        if (!dest)
+        {
+            if (size_remaining == size)
+            {
+                return rv ? rv : -ENOSPC;
+            }
+            break;
+        }
+
+        memcpy(dest + block_offset, data_iter, chunk);
+        image_unpin(mark);
+        size_remaining -= chunk;
+        data_iter += chunk;
+        offset += chunk;
+    }
+
+    // Set Size accordingly
+    if (inode->size < offset)
+    {
+        inode->size = offset;
+    }
+
+    // Don't let one file hold too much in memory
+    delalloc* da = pending[inode_number(inode)];
+    if (da && da->count >= delalloc_limit)
+    {
+        int rv = flush_inode(inode);
+        if (rv)
+        {
+            return rv;
+        }
+    }
+
+    return size - size_remaining;
+}
+
+// Map blocks for given range of inode up front, in contiguous runs
+int
+preallocate_inode(inode* inode, off_t offset, off_t length, int keep_size)
+{
+    if (inode_read_only(inode))
+    {
+        return -EROFS;
+    }
+
+    if (offset < 0 || length <= 0)
+    {
+        return -EINVAL;
+    }
+
+    off_t end = offset + length;
+    if (end > MAX_FILE_SIZE)
+    {
+        return -EFBIG;
+    }
+
+    // Blocks are never mapped past end of file
+    if (keep_size && end > inode->size)
+    {
+        end = inode->size;
+    }
+
+    if (offset >= end)
+    {
+        return 0;
+    }
+
+    // Pending data goes first so the range is laid out in file order,
+    // the inode is marked changed after anything the flush wrote back
+    int rv = flush_inode(inode);
+    if (rv)
+    {
+        return rv;
+    }
+    inode_changed(inode);
+
+    int first = offset / BLOCK_SIZE;
+    int last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (last > 1 && inode->indirect == BLOCK_NONE && place_indirect(inode, last - first) != 0)
+    {
+        return -ENOSPC;
+    }
+    if (!get_block_slot(inode, last - 1, 1))
+    {
+        return -ENOSPC;
+    }
+
+    // Count holes in range
+    int holes = 0;
+    for (int i = first; i < last; i++)
+    {
+        holes += *get_block_slot(inode, i, 0) == BLOCK_NONE;
+    }
+
+    if (holes > free_block_count - reserved_blocks)
+    {
+        return -ENOSPC;
+    }
+
+    // Fill holes in file order
+    int index = first;
+    while (holes)
+    {
+        while (*get_block_slot(inode, index, 0) != BLOCK_NONE)
+        {
+            index++;
+        }
+
+        int len;
+        int start = allocate_run(allocation_goal(inode, index), holes, &len);
+        for (int j = 0; j < len; index++)
+        {
+            int* slot = get_block_slot(inode, index, 1);
+            if (*slot == BLOCK_NONE)
+            {
+                *slot = start + j++;
+                clear_block(*slot);
+                inode->blocks++;
+                holes--;
+            }
+        }
+    }
+
+    if (end > inode->size)
+    {
+        inode->size = end;
+    }
+
+    return 0;
+}
+
+// Drop every block an indirect block maps along with the indirect block
+// itself, without copying it away from the snapshots it is shared with
+static void
+release_indirect(inode* inode)
+{
+    int* block_nums = get_block_num(inode->indirect);
+    for (int i = 0; i < INDIRECT_COUNT; i++)
+    {
+        if (block_mapped(block_nums[i]))
+        {
+            free_block(block_nums[i]);
+            inode->blocks--;
+        }
+    }
+
+    free_block(inode->indirect);
+    inode->indirect = BLOCK_NONE;
+}
+
+// Check if the indirect block holds nothing, neither blocks nor the
+// markers of a compressed cluster
+static int
+indirect_empty(inode* inode)
+{
+    int* block_nums = get_block_num(inode->indirect);
+    for (int i = 0; i < INDIRECT_COUNT; i++)
+    {
+        if (block_nums[i] != BLOCK_NONE)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Free data for file blocks in [first, last), O(blocks freed)
+static int
+free_block_range(inode* inode, int first, int last)
+{
+    int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (first >= last)
+    {
+        return 0;
+    }
+
+    // Compressed clusters go whole, or get taken apart if cut in two
+    int rv = 0;
+    if (first % CLUSTER_BLOCKS && cluster_compressed(inode, first / CLUSTER_BLOCKS))
+    {
+        rv = expand_cluster(inode, first / CLUSTER_BLOCKS);
+    }
+
+    if (!rv && last % CLUSTER_BLOCKS && cluster_compressed(inode, last / CLUSTER_BLOCKS))
+    {
+        if (last >= end)
+        {
+            last += CLUSTER_BLOCKS - last % CLUSTER_BLOCKS;
+        }
+        else
+        {
+            rv = expand_cluster(inode, last / CLUSTER_BLOCKS);
+        }
+    }
+
+    if (rv)
+    {
+        return rv;
+    }
+
+    // Shared indirect block going away entirely needs no copy
+    if (inode->indirect != BLOCK_NONE && check_block_shared(inode->indirect)
+        && first <= 1 && last >= end)
+    {
+        release_indirect(inode);
+    }
+
+    for (int i = first; i < last; i++)
+    {
+        int* slot = get_block_slot(inode, i, 0);
+        if (slot && *slot != BLOCK_NONE)
+        {
+            slot = get_block_slot(inode, i, 1);
+            if (!slot)
+            {
+                return -ENOSPC;
+            }
+
+            if (block_mapped(*slot))
+            {
+                free_block(*slot);
+                inode->blocks--;
+            }
+            *slot = BLOCK_NONE;
+        }
+        drop_pending(inode, i);
+    }
+
+    // Indirect block no longer maps or waits on anything
+    int inode_num = inode_number(inode);
+    delalloc* da = inode_num == -1 ? NULL : pending[inode_num];
+    int waiting = da ? da->count - (da->pages[0] != NULL) : 0;
+    if (inode->indirect != BLOCK_NONE && !waiting && indirect_empty(inode))
+    {
+        free_block(inode->indirect);
+        inode->indirect = BLOCK_NONE;
+    }
+
+    return 0;
+}
+
+// Zero part of a file block if it holds any data
+static int
+zero_block_range(inode* inode, int index, int start, int end)
+{
+    if (cluster_compressed(inode, index / CLUSTER_BLOCKS))
+    {
+        int rv = expand_cluster(inode, index / CLUSTER_BLOCKS);
+        if (rv)
+        {
+            return rv;
+        }
+    }
+
+    int* slot = get_block_slot(inode, index, 0);
+    void* page = get_pending(inode, index);
+    if (slot && block_mapped(*slot))
+    {
+        slot = get_block_slot(inode, index, 1);
+        if (!slot || unshare_block(inode, index, slot) != 0)
+        {
+            return -ENOSPC;
+        }
+        memset(get_block_writable(*slot) + start, 0, end - start);
+    }
+    else if (page)
+    {
+        memset(page + start, 0, end - start);
+    }
+
+    return 0;
+}
+
+// Change size of given inode, shrinking frees blocks and growing leaves a hole
+int
+truncate_inode(inode* inode, off_t size)
+{
+    if (inode_read_only(inode))
+    {
+        return -EROFS;
+    }
+
+    if (size < 0)
+    {
+        return -EINVAL;
+    }
+
+    if (size > MAX_FILE_SIZE)
+    {
+        return -EFBIG;
+    }
+
+    inode_changed(inode);
+
+    if (size < inode->size)
+    {
+        // Zero tail of last block so growing again reads zeros
+        int rv = 0;
+        if (size % BLOCK_SIZE)
+        {
+            rv = zero_block_range(inode, size / BLOCK_SIZE, size % BLOCK_SIZE, BLOCK_SIZE);
+        }
+
+        // Free whole blocks past the new end
+        int first = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int last = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (!rv)
+        {
+            rv = free_block_range(inode, first, last);
+        }
+
+        if (rv)
+        {
+            return rv;
+        }
+    }
+
+    inode->size = size;
+    stamp_mtime(inode);
+
+    return 0;
+}
+
+// Deallocate given range of inode without changing its size
+int
+punch_hole(inode* inode, off_t offset, off_t length)
+{
+    if (inode_read_only(inode))
+    {
+        return -EROFS;
+    }
+
+    if (offset < 0 || length <= 0)
+    {
+        return -EINVAL;
+    }
+
+    // Nothing to punch past end of file
+    off_t end = offset + length;
+    if (end > inode->size)
+    {
+        end = inode->size;
+    }
+
+    if (offset >= end)
+    {
+        return 0;
+    }
+
+    inode_changed(inode);
+
+    int first = offset / BLOCK_SIZE;
+    int last = (end - 1) / BLOCK_SIZE;
+
+    // Range within a single block
+    if (first == last)
+    {
+        if (offset % BLOCK_SIZE == 0 && (end % BLOCK_SIZE == 0 || end == inode->size))
+        {
+            return free_block_range(inode, first, first + 1);
+        }
+        return zero_block_range(inode, first, offset % BLOCK_SIZE, (end - 1) % BLOCK_SIZE + 1);
+    }
+
+    // Zero partial head and tail blocks
+    int rv = 0;
+    if (offset % BLOCK_SIZE)
+    {
+        rv = zero_block_range(inode, first, offset % BLOCK_SIZE, BLOCK_SIZE);
+        first++;
+    }
+
+    if (!rv && end % BLOCK_SIZE && end != inode->size)
+    {
+        rv = zero_block_range(inode, last, 0, end % BLOCK_SIZE);
+        last--;
+    }
+
+    // Free whole blocks in between
+    return rv ? rv : free_block_range(inode, first, last + 1);
+}
+
+// Count contiguous runs of blocks making up given inode
+int
+inode_extents(inode* inode)
+{
+    int extents = 0;
+    int prev = BLOCK_NONE;
+    int last = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (int i = 0; i < last; i++)
+    {
+        int* slot = get_block_slot(inode, i, 0);
+        if (!slot || !block_mapped(*slot))
+        {
+            continue;
+        }
+
+        if (prev == BLOCK_NONE || *slot != prev + 1)
+        {
+            extents++;
+        }
+        prev = *slot;
+    }
+
+    return extents;
+}
+
+// Score fragmentation of given inode from 0 (one run) to 100 (no two
+// blocks next to each other)
+int
+fragmentation_score(inode* inode)
+{
+    if (inode->blocks < 2)
+    {
+        return 0;
+    }
+
+    return (inode_extents(inode) - 1) * 100 / (inode->blocks - 1);
+}
+
+// Move blocks of given inode into one contiguous run, the old blocks
+// stay mapped until every block has been copied. A file sharing any
+// block is left alone with -EBUSY.
+int
+defrag_inode(inode* inode)
+{
+    if (inode_read_only(inode))
+    {
+        return -EROFS;
+    }
+
+    int rv = flush_inode(inode);
+    if (rv)
+    {
+        return rv;
+    }
+
+    if (inode_extents(inode) <= 1)
+    {
+        return 0;
+    }
+
+    // Blocks shared with a clone, snapshot or duplicate would be copied
+    // apart, so such files are left as they are
+    int last = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int i = 0; i < last; i++)
+    {
+        int* slot = get_block_slot(inode, i, 0);
+        if (slot && block_mapped(*slot) && check_block_shared(*slot))
+        {
+            return -EBUSY;
+        }
+    }
+
+    inode_changed(inode);
+
+    // Block map gets rewritten, so it has to be this file's own
+    if (inode->indirect != BLOCK_NONE && !get_block_slot(inode, 1, 1))
+    {
+        return -ENOSPC;
+    }
+
+    int count = inode->blocks;
+    if (count > free_block_count - reserved_blocks)
+    {
+        return -ENOSPC;
+    }
+
+    // Only worth it with a run big enough for the whole file
+    int len;
+    int start = allocate_run(0, count, &len);
+    if (len < count)
+    {
+        for (int j = 0; j < len; j++)
+        {
+            free_block(start + j);
+        }
+        return -ENOSPC;
+    }
+
+    // Copy data into the run
+    int j = 0;
+    int mark = image_pins();
+    for (int i = 0; i < last; i++)
+    {
+        int* slot = get_block_slot(inode, i, 0);
+        if (slot && block_mapped(*slot))
+        {
+            memcpy(get_block_writable(start + j++), get_block_num(*slot), BLOCK_SIZE);
+        }
+        image_unpin(mark);
+    }
+
+    // Copies reach the disk before the block map pointing at them, so a
+    // move cut short leaks the run rather than losing data
+    image_sync_blocks(start, count);
+
+    // Switch block map over and free old blocks
+    j = 0;
+    for (int i = 0; i < last; i++)
+    {
+        int* slot = get_block_slot(inode, i, 0);
+        if (slot && block_mapped(*slot))
+        {
+            slot = get_block_slot(inode, i, 1);
+            free_block(*slot);
+            *slot = start + j++;
+        }
+    }
+
+    return 0;
+}
+
+// Make dst share every data block of src, each block gets copied on the
+// first write to it from either file
+int
+clone_inode(inode* src, inode* dst)
+{
+    if (src->isdir || dst->isdir)
+    {
+        return -EISDIR;
+    }
+
+    if (src == dst)
+    {
+        return -EINVAL;
+    }
+
+    if (inode_read_only(dst))
+    {
+        return -EROFS;
+    }
+
+    int rv = flush_inode(src);
+    if (rv)
+    {
+        return rv;
+    }
+
+    rv = truncate_inode(dst, 0);
+    if (rv)
+    {
+        return rv;
+    }
+
+    // Block maps differ as soon as either file changes, so copy indirect
+    if (src->indirect != BLOCK_NONE)
+    {
+        dst->indirect = allocate_block();
+        if (dst->indirect == BLOCK_NONE)
+        {
+            return -ENOSPC;
+        }
+        memcpy(get_block_writable(dst->indirect), get_block_num(src->indirect), BLOCK_SIZE);
+    }
+    dst->block = src->block;
+
+    // Take a reference to each data block
+    int last = (src->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int i = 0; i < last; i++)
+    {
+        int* slot = get_block_slot(dst, i, 0);
+        if (slot && block_mapped(*slot))
+        {
+            add_ref(*slot);
+        }
+    }
+
+    // Compressed clusters only read back as such
+    dst->flags  = (dst->flags & ~INODE_COMPRESSED) | (src->flags & INODE_COMPRESSED);
+    dst->blocks = src->blocks;
+    dst->size   = src->size;
+    stamp_mtime(dst);
+
+    return 0;
+}
+
+// Take a reference to every block given inode refers to
+static void
+share_inode_blocks(inode* inode)
+{
+    if (block_mapped(inode->block))
+    {
+        add_ref(inode->block);
+    }
+
+    if (inode->indirect != BLOCK_NONE)
+    {
+        add_ref(inode->indirect);
+
+        int* block_nums = get_block_num(inode->indirect);
+        for (int i = 0; i < INDIRECT_COUNT; i++)
+        {
+            if (block_mapped(block_nums[i]))
+            {
+                add_ref(block_nums[i]);
+            }
+        }
+    }
+}
+
+// Drop the reference to every block given inode refers to
+static void
+release_inode_blocks(inode* inode)
+{
+    if (block_mapped(inode->block))
+    {
+        free_block(inode->block);
+    }
+
+    if (inode->indirect != BLOCK_NONE)
+    {
+        release_indirect(inode);
+    }
+}
+
+// Get number of the first snapshot in use at or after given number, or -1
+int
+next_snapshot(int snapshot_num)
+{
+    for (int i = snapshot_num; i < SNAPSHOT_COUNT; i++)
+    {
+        if (snapshot_base[i].table != BLOCK_NONE)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Get name of snapshot of given number
+const char*
+get_snapshot_name(int snapshot_num)
+{
+    return snapshot_base[snapshot_num].name;
+}
+
+// Freeze the live tree into a read-only snapshot, copying only the inode
+// table and bitmap and sharing every block the tree refers to
+int
+create_snapshot(const char* name)
+{
+    if (strlen(name) >= sizeof(snapshot_base->name))
+    {
+        return -ENAMETOOLONG;
+    }
+
+    if (find_snapshot(name, strlen(name)))
+    {
+        return -EEXIST;
+    }
+
+    int snapshot_num = 0;
+    while (snapshot_num < SNAPSHOT_COUNT && snapshot_base[snapshot_num].table != BLOCK_NONE)
+    {
+        snapshot_num++;
+    }
+
+    if (snapshot_num == SNAPSHOT_COUNT)
+    {
+        return -EMLINK;
+    }
+
+    // Delayed writes belong in the snapshot
+    storage_flush();
+
+    // Frozen table is one run of the live table's chunks, so it can be
+    // indexed directly by inode number
+    int count = sb->inode_chunks;
+    if (count > free_block_count - reserved_blocks)
+    {
+        return -ENOSPC;
+    }
+
+    int len;
+    int start = allocate_run(0, count, &len);
+    if (len < count)
+    {
+        for (int j = 0; j < len; j++)
+        {
+            free_block(start + j);
+        }
+        return -ENOSPC;
+    }
+
+    int mark = image_pins();
+    for (int c = 0; c < count; c++)
+    {
+        memcpy(get_block_writable(start + c), get_block_num(chunk_blocks[c]), BLOCK_SIZE);
+        image_unpin(mark);
+    }
+
+    // Live tree copies blocks away from here on before changing them
+    for (int i = next_inode(0); i != -1; i = next_inode(i + 1))
+    {
+        share_inode_blocks(get_inode_num(i));
+        image_unpin(mark);
+    }
+
+    snapshot* snap = snapshot_base + snapshot_num;
+    strcpy(snap->name, name);
+    snap->created = time(0);
+    snap->blocks  = count;
+    snap->table   = start;
+
+    return 0;
+}
+
+// Delete snapshot of given name, freeing blocks nothing else refers to
+int
+delete_snapshot(const char* name)
+{
+    snapshot* snap = find_snapshot(name, strlen(name));
+    if (!snap)
+    {
+        return -ENOENT;
+    }
+
+    int mark = image_pins();
+    for (int i = 0; i < snap->blocks * INODES_PER_CHUNK; i++)
+    {
+        inode* node = table_inode(snap, i);
+        if (node->mode)
+        {
+            release_inode_blocks(node);
+        }
+        image_unpin(mark);
+    }
+
+    for (int j = 0; j < snap->blocks; j++)
+    {
+        free_block(snap->table + j);
+    }
+    snap->table = BLOCK_NONE;
+
+    return 0;
+}
+
+// Count a reference an inode makes to given block, reporting block numbers
+// that point outside the image
+static int
+count_block_ref(int* refs, int inode_num, int block_num)
+{
+    if (block_num == BLOCK_NONE || block_num == BLOCK_COMPRESSED)
+    {
+        return 0;
+    }
+
+    if (block_num < 0 || block_num >= block_count)
+    {
+        printf("inode %d: block number %d out of range\n", inode_num, block_num);
+        return 1;
+    }
+
+    refs[block_num]++;
+    return 0;
+}
+
+// Count references the inodes in use in a run of count inodes make to
+// blocks, the first of them being inode number first
+static int
+count_table_refs(inode* table, int first, int count, int* refs)
+{
+    int problems = 0;
+    for (int n = 0; n < count; n++)
+    {
+        inode* node = table + n;
+        int i = first + n;
+        if (!node->mode)
+        {
+            continue;
         }
-        else
+
+        problems += count_block_ref(refs, i, node->block);
+        if (node->indirect == BLOCK_NONE)
         {
-            // Clean Up
-            delete_vector(dirs);
+            continue;
+        }
 
-            return -ENOTDIR;
+        // Slots of a bad indirect block can't be trusted
+        if (count_block_ref(refs, i, node->indirect))
+        {
+            problems++;
+            continue;
         }
 
+        int* block_nums = get_block_num(node->indirect);
+        for (int j = 0; j < INDIRECT_COUNT; j++)
+        {
+            problems += count_block_ref(refs, i, block_nums[j]);
+        }
     }
+    return problems;
+}
 
-    // Clean Up
-    delete_vector(dirs);
+// Write all of len bytes to fd
+static int
+write_full(int fd, const void* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t put = write(fd, data, len);
+        if (put < 0)
+        {
+            return -errno;
+        }
+        data += put;
+        len -= put;
+    }
+    return 0;
+}
 
-    // Return inode number
-    return inode_num;
+// Read all of len bytes from fd, running out early is an error
+static int
+read_full(int fd, void* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t got = read(fd, data, len);
+        if (got <= 0)
+        {
+            return got < 0 ? -errno : -EIO;
+        }
+        data += got;
+        len -= got;
+    }
+    return 0;
 }
 
-// Unlink the given path from its inode and delete the inode if necessary
+// Get the checkpoint changed blocks are tracked since
 int
-unlink_inode(const char* path, int directory)
+storage_generation()
 {
-    // Split Path by directory delimiters
-    vector* dirs = str_split(path, '/');
-
-    // Start at root directory
-    inode* it = inode_base;
+    return sb->generation;
+}
 
-    // Loop through path until found
-    for (int path_iter = 0; path_iter < dirs->size; path_iter++)
+// Write the blocks changed since given generation to fd, then start a new
+// checkpoint. Generation 0 sends every block, anything else has to be the
+// current checkpoint. Returns how many blocks were sent.
+int
+write_changes(int fd, int since)
+{
+    if (since != 0 && since != sb->generation)
     {
-        // Get next directory/filename
-        char* name = vector_get(dirs, path_iter);
+        return -EINVAL;
+    }
 
-        // We are in a directory
-        if (it->isdir)
+    delta_header head;
+    head.magic       = DELTA_MAGIC;
+    head.version     = NUFS_VERSION;
+    head.from        = since;
+    head.to          = sb->generation + 1;
+    head.block_count = block_count;
+    head.meta_size   = meta_size;
+    int rv = write_full(fd, &head, sizeof(head));
+
+    int sent = 0;
+    int mark = image_pins();
+    for (int i = 0; i < block_count && rv == 0; i++)
+    {
+        if (since && !block_changed(i))
         {
-            // Find block containing directory map
-            map* dirmap = get_block_num(it->block);
-
-            // Get inode number for next directory/filename
-            int inode_num = map_get(dirmap, name);
-
-            // Last piece of path
-            if (path_iter == dirs->size - 1)
-            {
-                // Doesn't Exist
-                if (inode_num == -1)
-                {
-                    // Clean Up
-                    delete_vector(dirs);
+            continue;
+        }
 
-                    return -ENOENT;
-                }
+        delta_record record = { i, block_written(i) != 0 };
+        rv = write_full(fd, &record, sizeof(record));
+        if (rv == 0 && record.has_data)
+        {
+            rv = write_full(fd, get_block_num(i), BLOCK_SIZE);
+        }
+        image_unpin(mark);
+        sent++;
+    }
 
-                // Deal with directories
-                if (get_inode_num(inode_num)->isdir && !directory)
-                {
-                    return -EISDIR;
-                }
+    delta_record end = { -1, 0 };
+    if (rv == 0)
+    {
+        rv = write_full(fd, &end, sizeof(end));
+    }
 
-                // Deal with non-directories
-                if (!get_inode_num(inode_num)->isdir && directory)
-                {
-                    return -ENOTDIR;
-                }
+    // Superblock and snapshots as of the new checkpoint, the rest of the
+    // metadata only for blocks that changed, so an idle stream stays small
+    size_t top_size = (void*)block_map_base - (void*)sb;
+    superblock* top = malloc(top_size);
+    memcpy(top, sb, top_size);
+    top->generation = head.to;
+    if (rv == 0)
+    {
+        rv = write_full(fd, top, top_size);
+    }
+    free(top);
 
-                // Remove from Directory Map
-                map_remove(dirmap, name);
-                it->refs--;
+    for (int i = 0; i < block_count && rv == 0; i++)
+    {
+        if (since && !block_changed(i) && !block_recounted(i))
+        {
+            continue;
+        }
 
-                // Clean up if last reference
-                if (!it->refs)
-                {
-                    block_map_base[it->block] = 0;
-                    int* block_nums = (it->indirect != -1) ? get_block_num(it->indirect) : NULL;
-                    for (int i = 0; i < it->blocks - 1; i++)
-                    {
-                        block_map_base[block_nums[i]] = 0;
-                    }
-                }
+        delta_entry entry = { i, block_map_base[i], checksum_base[i], block_written(i) != 0 };
+        rv = write_full(fd, &entry, sizeof(entry));
+    }
 
-                // Clean Up
-                delete_vector(dirs);
+    delta_entry last = { -1, 0, 0, 0 };
+    if (rv == 0)
+    {
+        rv = write_full(fd, &last, sizeof(last));
+    }
 
-                return 0;
-            }
+    if (rv != 0)
+    {
+        return rv;
+    }
 
-            // Move to next directory
-            it = get_inode_num(inode_num);
-        }
-        else
-        {
-            // Clean Up
-            delete_vector(dirs);
+    // Only a stream that made it out moves the checkpoint
+    sb->generation = head.to;
+    memset(changed_base, 0, (block_count + 7) / 8);
+    memset(recounted_base, 0, (block_count + 7) / 8);
+    return sent;
+}
 
-            return -ENOTDIR;
-        }
+// Header of a stream read ahead by changes_image_size
+static delta_header stream_head;
+static int stream_head_read = 0;
 
+// Read the header of a stream from write_changes on fd and get the size
+// of the image it was taken from, so that a new copy can be made to
+// match. apply_changes then goes on with the rest of the stream.
+long
+changes_image_size(int fd)
+{
+    int rv = read_full(fd, &stream_head, sizeof(stream_head));
+    if (rv != 0)
+    {
+        return rv;
     }
 
-    // Clean Up
-    delete_vector(dirs);
+    if (stream_head.magic != DELTA_MAGIC || stream_head.block_count < 1)
+    {
+        return -EINVAL;
+    }
 
-    return 0;
+    stream_head_read = 1;
+    return stream_head.meta_size + (long)stream_head.block_count * BLOCK_SIZE;
 }
 
-// Create a hard link from given path to new one
+// Replay a stream from write_changes read from fd onto the image, which
+// has to be at the generation the stream was taken from unless it is a
+// full copy. The whole stream is read before anything is written, holding
+// only the blocks it carries, and the image has to be opened afresh
+// before it is used again. Returns how many blocks were written.
 int
-link_inode(const char* path, const char* new)
+apply_changes(int fd)
 {
-    // Split Path by directory delimiters
-    vector* dirs = str_split(new, '/');
-
-    // Start at root directory
-    inode* it = inode_base;
+    delta_header head = stream_head;
+    int rv = stream_head_read ? 0 : read_full(fd, &head, sizeof(head));
+    stream_head_read = 0;
+    if (rv != 0)
+    {
+        return rv;
+    }
 
-    inode* node = get_inode(path);
-    int inode_num = ((long long)node - (long long)inode_base) / sizeof(inode);
+    if (head.magic != DELTA_MAGIC || head.version != NUFS_VERSION
+        || head.block_count != block_count || head.meta_size != (int)meta_size)
+    {
+        return -EINVAL;
+    }
 
-    // Loop through path until found
-    for (int path_iter = 0; path_iter < dirs->size; path_iter++)
+    if (head.from && head.from != sb->generation)
     {
-        // Get next directory/filename
-        char* name = vector_get(dirs, path_iter);
+        return -ESTALE;
+    }
 
-        // We are in a directory
-        if (it->isdir)
+    // Blocks sent without data stay NULL and are written as zeros
+    char** data = calloc(block_count, sizeof(char*));
+    char* present = calloc(block_count, 1);
+    size_t top_size = (void*)block_map_base - (void*)sb;
+    void* top = malloc(top_size);
+    delta_entry* entries = NULL;
+    int entry_count = 0;
+    int entry_cap = 0;
+
+    delta_record record;
+    while ((rv = read_full(fd, &record, sizeof(record))) == 0 && record.block != -1)
+    {
+        if (record.block < 0 || record.block >= block_count)
         {
-            // Find block containing directory map
-            map* dirmap = get_block_num(it->block);
+            rv = -EINVAL;
+            break;
+        }
 
-            // Get inode number for next directory/filename
-            int dnode_num = map_get(dirmap, name);
+        present[record.block] = 1;
+        if (record.has_data)
+        {
+            if (!data[record.block])
+            {
+                data[record.block] = malloc(BLOCK_SIZE);
+            }
 
-            // Last piece of path
-            if (path_iter == dirs->size - 1)
+            rv = read_full(fd, data[record.block], BLOCK_SIZE);
+            if (rv != 0)
             {
-                // Check for File Exists
-                if (dnode_num != -1)
-                {
-                    // Clean Up
-                    delete_vector(dirs);
+                break;
+            }
+        }
+        else
+        {
+            free(data[record.block]);
+            data[record.block] = NULL;
+        }
+    }
 
-                    return -EEXIST;
-                }
+    if (rv == 0)
+    {
+        rv = read_full(fd, top, top_size);
+    }
 
-	        map_add(dirmap, name, inode_num);
-                node->refs++;
-                
-                // Clean Up
-                delete_vector(dirs);
+    while (rv == 0)
+    {
+        if (entry_count == entry_cap)
+        {
+            entry_cap = entry_cap ? entry_cap * 2 : 64;
+            entries = realloc(entries, entry_cap * sizeof(delta_entry));
+        }
 
-                return 0;
-            }
+        delta_entry* entry = entries + entry_count;
+        rv = read_full(fd, entry, sizeof(delta_entry));
+        if (rv != 0 || entry->block == -1)
+        {
+            break;
+        }
 
-            // Check for directory Exists
-            if (inode_num == -1)
-            {
-                // Clean Up
-                delete_vector(dirs);
+        if (entry->block < 0 || entry->block >= block_count)
+        {
+            rv = -EINVAL;
+            break;
+        }
+        entry_count++;
+    }
 
-                return -ENOENT;
+    int applied = 0;
+    int mark = image_pins();
+    for (int i = 0; i < block_count; i++)
+    {
+        if (rv == 0 && present[i])
+        {
+            // Blocks never written here are zeros already, and stay holes
+            if (data[i])
+            {
+                memcpy(get_block_num(i), data[i], BLOCK_SIZE);
+                image_dirty(i);
             }
-
-            // Move to next directory
-            it = get_inode_num(inode_num);
+            else if (block_written(i))
+            {
+                memset(get_block_num(i), 0, BLOCK_SIZE);
+                image_dirty(i);
+            }
+            image_unpin(mark);
+            applied++;
         }
+        free(data[i]);
+    }
 
+    // Block map entries go with the blocks, nothing is changed since the
+    // new checkpoint
+    if (rv == 0)
+    {
+        memcpy(sb, top, top_size);
+        for (int j = 0; j < entry_count; j++)
+        {
+            int i = entries[j].block;
+            block_map_base[i] = entries[j].refs;
+            checksum_base[i] = entries[j].checksum;
+            if (entries[j].written)
+            {
+                written_base[i / 8] |= 1 << i % 8;
+            }
+            else
+            {
+                written_base[i / 8] &= ~(1 << i % 8);
+            }
+        }
+        memset(changed_base, 0, (block_count + 7) / 8);
+        memset(recounted_base, 0, (block_count + 7) / 8);
+
+        // Checksums now match the blocks as they did on the sealed source
+        image_writeback();
+        image_sync();
+        *sealed_base = 1;
+        image_meta_sync(sealed_base, sizeof(int));
     }
 
     // Clean Up
-    delete_vector(dirs);
-
-    // Return where we got out of iteration loop
-    return 0;
+    free(data);
+    free(present);
+    free(top);
+    free(entries);
+    return rv ? rv : applied;
 }
 
-// Get inode info for given path
+// Check the inode table, block reference counts, directory maps and link
+// counts, printing each problem found and returning how many there are.
+// Only reads the image, checksums are left to check_block.
 int
-get_stat(inode* inode, struct stat* st)
-{
-    // Clear stat structure
-    memset(st, 0, sizeof(struct stat));
-
-    // Assign values
-    st->st_mode    = inode->mode;
-    st->st_nlink   = inode->refs;
-    st->st_uid     = inode->uid;
-    st->st_gid     = inode->gid;
-    st->st_size    = inode->size;
-    st->st_blocks  = inode->blocks;
-    st->st_blksize = BLOCK_SIZE;
-    st->st_mtim.tv_sec = inode->mtime;
-
-    // Success
-    return 0;
-}
-
-// Get data from given inode
-void*
-get_data(inode* inode)
+check_storage()
 {
-    // Allocate some data
-    void* data = malloc(inode->size);
+    int problems = 0;
 
-    // Only has direct block
-    if (inode->size <= BLOCK_SIZE)
+    // Nothing else can be checked without a sound inode table, the chunk
+    // list itself was followed at mount
+    if (sb->inode_chunks < 1 || sb->inode_chunks > block_count)
     {
-        memcpy(data, get_block_num(inode->block), inode->size);
-        return data;
+        printf("superblock: bad inode chunk count %d\n", sb->inode_chunks);
+        return 1;
     }
 
-    // Prepare to iterate indirect block
-    void* data_iter = data;
-    int size_remaining = inode->size;
+    // Each block is referred to once per inode and inode table using it,
+    // and once by the chunk list if it holds part of the live table
+    int* refs = calloc(block_count, sizeof(int));
+    for (int l = 0; l < (sb->inode_chunks + CHUNKS_PER_LIST - 1) / CHUNKS_PER_LIST; l++)
+    {
+        refs[list_blocks[l]]++;
+    }
 
-    // Get data from direct block first
-    memcpy(data_iter, get_block_num(inode->block), BLOCK_SIZE);
-    size_remaining -= BLOCK_SIZE;
-    data_iter += BLOCK_SIZE;
+    int mark = image_pins();
+    for (int c = 0; c < sb->inode_chunks; c++)
+    {
+        refs[chunk_blocks[c]]++;
+        problems += count_table_refs(get_block_num(chunk_blocks[c]), c * INODES_PER_CHUNK,
+                                     INODES_PER_CHUNK, refs);
+        image_unpin(mark);
+    }
 
-    // Loop through indirect blocks
-    int* block_nums = get_block_num(inode->indirect);
-    for (int i = 0; i < INDIRECT_COUNT; i++)
+    for (int s = 0; s < SNAPSHOT_COUNT; s++)
     {
-        // Get data block
-        void* block = get_block_num(block_nums[i]);
+        snapshot* snap = snapshot_base + s;
+        if (snap->table == BLOCK_NONE)
+        {
+            continue;
+        }
 
-        // Final Block
-        if (size_remaining <= BLOCK_SIZE)
+        if (snap->table < 0 || snap->blocks < 1 || snap->table + snap->blocks > block_count)
         {
-            memcpy(data_iter, block, size_remaining);
-            return data;
+            printf("snapshot %d: bad table at block %d\n", s, snap->table);
+            problems++;
+            continue;
         }
 
-        // Copy whole block
-        memcpy(data_iter, block, BLOCK_SIZE);
-        size_remaining -= BLOCK_SIZE;
-        data_iter += BLOCK_SIZE;
+        for (int j = 0; j < snap->blocks; j++)
+        {
+            refs[snap->table + j]++;
+            problems += count_table_refs(get_block_num(snap->table + j), j * INODES_PER_CHUNK,
+                                         INODES_PER_CHUNK, refs);
+            image_unpin(mark);
+        }
     }
 
-    assert(0);
-}
-
-// Write data into given inode
-int
-write_data(inode* inode, const void* buf, size_t size, off_t offset)
-{
-    // Set Size accordingly
-    if (inode->size < size + offset)
+    for (int i = 0; i < block_count; i++)
     {
-        inode->size = size + offset;
+        if (refs[i] != block_map_base[i])
+        {
+            printf("block %d: %d references, block map says %d\n", i, refs[i], block_map_base[i]);
+            problems++;
+        }
     }
+    free(refs);
 
-    // Data will fit in direct block
-    if (size + offset <= BLOCK_SIZE)
+    // Free counts kept as blocks and inodes come and go match the maps
+    int blocks_found = 0;
+    for (int i = 0; i < block_count; i++)
     {
-        memcpy(get_block_num(inode->block) + offset, buf, size);
-        char* data = get_data(inode); 
-        return size;
+        blocks_found += check_block_free(i);
     }
 
-    // Prepare to iterate indirect block
-    if (inode->indirect == -1)
+    int inodes_found = 0;
+    for (int i = 0; i < inode_count; i++)
     {
-        inode->indirect = allocate_block();
-        if (inode->indirect == -1)
-        {
-            return ENOSPC;
-        }
+        inodes_found += check_inode_free(i);
     }
-    const void* data_iter = buf;
-    int size_remaining = size;
 
-    // Write data to direct block first
-    if (offset < BLOCK_SIZE)
+    if (blocks_found != free_block_count || inodes_found != free_inode_count)
     {
-        memcpy(get_block_num(inode->block) + offset, data_iter, BLOCK_SIZE - offset);
-        size_remaining -= BLOCK_SIZE - offset;
-        data_iter += BLOCK_SIZE - offset;
-        offset = 0;
-    }
-    else
-    {
-        offset -= BLOCK_SIZE;
+        printf("free counts say %d blocks and %d inodes, found %d and %d\n",
+               free_block_count, free_inode_count, blocks_found, inodes_found);
+        problems++;
     }
 
-    // Loop through indirect blocks
-    int* block_nums = get_block_num(inode->indirect);
-    for (int i = 0; i < INDIRECT_COUNT; i++)
+    // Directory entries name inodes in use
+    int* names = calloc(inode_count, sizeof(int));
+    int* subdirs = calloc(inode_count, sizeof(int));
+    for (int i = next_inode(0); i != -1; i = next_inode(i + 1))
     {
-        // Allocate block if necessary
-        if (block_nums[i] == 0)
+        inode* dir = get_inode_num(i);
+        if (!dir->isdir || dir->block < 0 || dir->block >= block_count)
         {
-            block_nums[i] = allocate_block();
-            if (block_nums[i] == -1)
-            {
-                return -ENOSPC;
-            }
-            inode->blocks++;
+            continue;
         }
 
-        // Get data block
-        void* block = get_block_num(block_nums[i]);
+        map* dirmap = get_block_num(dir->block);
+        if (!map_valid(dirmap))
+        {
+            printf("directory %d: bad map\n", i);
+            problems++;
+            continue;
+        }
 
-        // Final Block
-        if (size_remaining + offset <= BLOCK_SIZE)
+        for (int j = 0; j < dirmap->size; j++)
         {
-            memcpy(block + offset, data_iter, size_remaining);
-            char* data = get_data(inode); 
-            return size;
+            int inode_num = map_inode(dirmap, j);
+            if (inode_num < 0 || inode_num >= inode_count || check_inode_free(inode_num))
+            {
+                printf("directory %d: %s refers to free inode %d\n", i, map_name(dirmap, j), inode_num);
+                problems++;
+            }
+            else
+            {
+                names[inode_num]++;
+                subdirs[i] += get_inode_num(inode_num)->isdir;
+            }
         }
+        image_unpin(mark);
+    }
 
-        // Copy whole block
-        if (offset < BLOCK_SIZE)
+    // Files have a link for each name, directories have one name and a
+    // link from each subdirectory, everything but root has a name
+    for (int i = next_inode(0); i != -1; i = next_inode(i + 1))
+    {
+        inode* node = get_inode_num(i);
+        if (i != 0 && !names[i])
         {
-            memcpy(block + offset, data_iter, BLOCK_SIZE - offset);
-            size_remaining -= BLOCK_SIZE - offset;
-            data_iter += BLOCK_SIZE - offset;
-            offset = 0;
+            printf("inode %d: not in any directory\n", i);
+            problems++;
         }
-        else
+        else if (!node->isdir && node->refs != names[i])
+        {
+            printf("inode %d: %d links, found %d names\n", i, node->refs, names[i]);
+            problems++;
+        }
+        else if (node->isdir && (names[i] > 1 || node->refs != 2 + subdirs[i]))
         {
-            offset -= BLOCK_SIZE;
+            printf("directory %d: %d links, found %d names and %d subdirectories\n",
+                   i, node->refs, names[i], subdirs[i]);
+            problems++;
         }
+        image_unpin(mark);
     }
+    free(names);
+    free(subdirs);
 
-    return -EFBIG;
+    return problems;
 }
@@ -1,32 +1,89 @@
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
+// Read-only directory holding one subdirectory per snapshot
+#define SNAPSHOT_DIR "/.snapshots"
+
+// Flags for mapping the image at mount
+#define STORAGE_POPULATE  1 // Fault in metadata and the inode table up front
+#define STORAGE_HUGEPAGES 2 // Back a scratch image with transparent huge pages
+#define STORAGE_SCRATCH   4 // Keep the image in memory only
+#define STORAGE_PERSIST   8 // Load a scratch image from its file and save it back
+#define STORAGE_READONLY 16 // Only look at the image, nothing is written
+
+// Inode flags
+#define INODE_COMPRESSED 1 // Data gets compressed on flush, inherited by new files
+
+// One cache line per inode, with the fields lookups, reads and writes
+// touch ahead of the ones only stat needs
 typedef struct inode {
-    int mode;
-    int uid;
-    int size;
-    time_t mtime;
-    int gid;
-    int refs;
-    int blocks;
-    int isdir;
-    int block;
-    int indirect;
+    int64_t size;
+    int     block;
+    int     indirect;
+    int     mode;
+    int     isdir;
+    int     flags;
+    int     refs;
+    int     blocks;
+    int     uid;
+    int     gid;
+    int     mtime_nsec;
+    int64_t mtime;
+    int64_t reserved;
 } inode;
 
-void   storage_init(const char* path);
+void   storage_size(long bytes);
+void   storage_cache(long bytes);
+void   storage_stripe(const char* paths, long unit_bytes);
+void   storage_init(const char* path, int flags);
+void   storage_release();
+int    storage_pins();
+void   storage_unpin(int mark);
 void*  get_block_num(int block_num);
+int    get_block_count();
+int    check_block(int block_num);
+int    storage_clean();
 inode* get_inode_num(int inode_num);
+inode* get_inode_writable(int inode_num);
+void   inode_changed(inode* inode);
+int    next_inode(int inode_num);
 inode* get_inode(const char* path);
+inode* get_entry_inode(inode* dir, int inode_num);
+int    inode_read_only(inode* inode);
 int    make_inode(const char* path, mode_t mode);
 int    unlink_inode(const char* path, int directory);
 int    link_inode(const char* path, const char* new);
+int    rename_inode(const char* path, const char* new);
 int    get_stat(inode* inode, struct stat* st);
-void*  get_data(inode* inode);
+int    get_statfs(struct statvfs* st);
+int    read_data(inode* inode, void* buf, size_t size, off_t offset);
 int    write_data(inode* inode, const void* buf, size_t size, off_t offset);
+int    truncate_inode(inode* inode, off_t size);
+int    punch_hole(inode* inode, off_t offset, off_t length);
+int    preallocate_inode(inode* inode, off_t offset, off_t length, int keep_size);
+int    flush_inode(inode* inode);
+int    sync_inode(inode* inode);
+void   storage_flush();
+void   storage_save();
+void   storage_dedup();
+int    inode_extents(inode* inode);
+int    fragmentation_score(inode* inode);
+int    defrag_inode(inode* inode);
+int    clone_inode(inode* src, inode* dst);
+int    next_snapshot(int snapshot_num);
+const char* get_snapshot_name(int snapshot_num);
+int    create_snapshot(const char* name);
+int    delete_snapshot(const char* name);
+int    storage_generation();
+int    write_changes(int fd, int since);
+long   changes_image_size(int fd);
+int    apply_changes(int fd);
+int    check_storage();
 
 #endif
@@ -2,11 +2,14 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 70;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts, $image) = @_;
+    $opts = $opts ? "OPTS='$opts'" : "";
+    $opts .= $image ? " IMAGE=$image" : "";
+    system("(make mount $opts 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -131,6 +134,31 @@ my $msg7 = read_text("foo/abc.txt");
 say "# '$msg2' eq '$msg7'?";
 ok($msg2 eq $msg7, "Read back data from copy in subdir.");
 
+system("mkdir mnt/bar && mv mnt/bar mnt/foo/baz");
+ok(-d "mnt/foo/baz" && !-e "mnt/bar", "Moved a directory into a subdir");
+
+# Replace a file the way editors save: write a temp file, rename over
+my $oldtext = "old contents " x 2000;
+my $newtext = "new contents " x 2000;
+write_text("replace.txt", $oldtext);
+my @kept = split /\s+/, `df -B4096 mnt | tail -1`;
+write_text("replace.tmp", $newtext);
+rename("mnt/replace.tmp", "mnt/replace.txt");
+my @swapped = split /\s+/, `df -B4096 mnt | tail -1`;
+say "# free blocks $kept[3] before, $swapped[3] after";
+ok(read_text("replace.txt") eq $newtext && !-e "mnt/replace.tmp"
+   && (stat("mnt/replace.txt"))[3] == 1 && abs($kept[3] - $swapped[3]) <= 1,
+   "Rename over a file replaces it and frees the old one");
+
+write_text("replace2.txt", $oldtext);
+system("ln mnt/replace2.txt mnt/replace2.old");
+write_text("replace2.tmp", $newtext);
+rename("mnt/replace2.tmp", "mnt/replace2.txt");
+ok(read_text("replace2.txt") eq $newtext && read_text("replace2.old") eq $oldtext
+   && (stat("mnt/replace2.txt"))[3] == 1 && (stat("mnt/replace2.old"))[3] == 1,
+   "Rename over a linked file leaves its other name and fixes link counts");
+system("rm -f mnt/replace.txt mnt/replace2.txt mnt/replace2.old");
+
 my $huge0 = "=This string is fourty characters long.=" x 1000;
 write_text("40k.txt", $huge0);
 my $huge1 = read_text("40k.txt");
@@ -140,4 +168,273 @@ my $huge2 = read_text_slice("40k.txt", 10, 8050);
 $right = "ng is four";
 ok($huge2 eq $right, "Read with offset & length");
 
+system("./nufs-clone mnt/40k.txt mnt/foo/40k.txt");
+my $huge3 = read_text("foo/40k.txt");
+ok($huge0 eq $huge3, "Read back 40k from clone in subdir");
+
+say "#           == Truncate Tests ==";
+
+system("truncate -s 5 mnt/40k.txt");
+ok(-s "mnt/40k.txt" == 5, "Shrunk 40k.txt with truncate");
+my $short = read_text("40k.txt");
+ok($short eq "=This", "Read back data after shrink");
+
+system("truncate -s 20000 mnt/40k.txt");
+ok(-s "mnt/40k.txt" == 20000, "Grew 40k.txt with truncate");
+my $hole = read_text_slice("40k.txt", 10, 10000);
+ok($hole eq "\0" x 10, "Read zeros from hole");
+
+open my $sfh, ">", "mnt/sparse.bin";
+seek $sfh, 3000000, 0;
+print $sfh "end";
+close $sfh;
+my $tail = read_text_slice("sparse.bin", 3, 3000000);
+ok($tail eq "end", "Read back data written at large offset");
+
+system("fallocate -l 65536 mnt/prealloc.bin");
+ok(-s "mnt/prealloc.bin" == 65536, "Preallocated file with fallocate");
+
+write_text("flushed.bin", "contiguous " x 6000);
+unmount();
+my $layout = `./nufs-defrag -n data.nufs /flushed.bin /prealloc.bin`;
+say "# $layout";
+ok($layout =~ /flushed\.bin: 17 blocks in 1 extents/ && $layout =~ /prealloc\.bin: 16 blocks in 1 extents/,
+   "Flushed and preallocated files are laid out contiguously");
+mount();
+
+say "#           == Snapshot Tests ==";
+
+system("mkdir mnt/.snapshots/before");
+write_text("def.txt", "changed");
+my $snap = read_text(".snapshots/before/def.txt");
+say "# '$msg2' eq '$snap'?";
+ok($msg2 eq $snap, "Read old data from snapshot");
+my $live = read_text("def.txt");
+ok($live eq "changed", "Read new data from live file");
+
+say "#           == Compression Tests ==";
+
+system("mkdir mnt/packed");
+system("chattr +c mnt/packed");
+my $text = "compress me " x 4000;
+write_text("packed/data.txt", $text);
+system("sync mnt/packed/data.txt");
+my $unpacked = read_text("packed/data.txt");
+ok($text eq $unpacked, "Read back data from compressed file");
+my $packed = (stat("mnt/packed/data.txt"))[12] * 512;
+say "# " . length($text) . " bytes take $packed on disk";
+ok($packed > 0 && $packed < length($text) / 2, "Compressed file takes less space than its data");
+
+my $cut = "compress me " x 2500;
+write_text("packed/cut.txt", $cut);
+system("sync mnt/packed/cut.txt");
+truncate("mnt/packed/cut.txt", 16384);
+unmount();
+system("./fsck.nufs data.nufs >> test.log");
+my $cut_fsck = $?;
+mount();
+ok(read_text("packed/cut.txt") eq substr($cut, 0, 16384) && $cut_fsck == 0,
+   "Truncated compressed file keeps its data and passes fsck");
+
+say "#           == Dedup Tests ==";
+
 unmount();
+mount("-o dedup,populate");
+ok(read_text("2k.txt") eq $long0, "Read back data with the image populated at mount");
+
+my @before = split /\s+/, `df -B4096 mnt | tail -1`;
+my $same = "same old bytes " x 3000;
+write_text("copy1.txt", $same);
+write_text("copy2.txt", $same);
+system("sync mnt/copy1.txt mnt/copy2.txt");
+my @after = split /\s+/, `df -B4096 mnt | tail -1`;
+say "# twins took " . ($before[3] - $after[3]) . " blocks";
+ok($before[3] - $after[3] < 18, "Identical files share their data blocks");
+write_text("copy2.txt", "different");
+ok(read_text("copy1.txt") eq $same, "Deduplicated file survives change to its twin");
+
+say "#           == Inode Table Tests ==";
+
+for my $d (1..3) {
+    mkdir "mnt/many$d";
+    system("cd mnt/many$d && touch " . join(" ", map { "f$_" } (1..40)));
+}
+ok(-e "mnt/many3/f40", "Created more files than a fixed table held");
+
+my $longname = "n" x 200;
+write_text("many1/$longname", "long");
+ok(read_text("many1/$longname") eq "long", "Read back file with a 200 byte name");
+
+my @df = split /\s+/, `df -B4096 mnt | tail -1`;
+ok($df[1] == 255 && $df[3] < 255, "df reports size and free space of image");
+
+unmount();
+
+say "#           == Import/Export Tests ==";
+
+system("rm -rf seed unpacked && mkdir -p seed/sub && echo imported > seed/sub/in.txt");
+system("./nufs-import data.nufs seed /foo >> test.log && ./nufs-export data.nufs unpacked /foo >> test.log");
+ok(read_text("../unpacked/sub/in.txt") eq "imported", "Exported a file imported into the image");
+
+system("rm -f fresh.nufs && ./nufs-import -s 1024 fresh.nufs seed >> test.log");
+ok(-s "fresh.nufs" > 1000 * 1024 * 1024 && (stat("fresh.nufs"))[12] * 512 < 1024 * 1024,
+   "New 1GB image is created sparse");
+system("rm -rf seed unpacked fresh.nufs");
+
+system("rm -f big.nufs");
+mount("-o size=64", "big.nufs");
+my $bulk = "x" x (3 * 1024 * 1024);
+write_text("bulk.txt", $bulk);
+@df = split /\s+/, `df -B4096 mnt | tail -1`;
+ok($df[1] > 16000 && read_text("bulk.txt") eq $bulk, "Image sized at mount holds more than 1MB");
+unmount();
+system("rm -f big.nufs");
+
+say "#           == Block Cache Tests ==";
+
+mount("-o cache=1");
+my $cached = "through the cache " x 3000;
+write_text("cached.txt", $cached);
+system("fallocate -l 65536 mnt/cached.bin");
+unmount();
+system("./fsck.nufs data.nufs >> test.log");
+my $cached_fsck = $?;
+mount();
+ok(read_text("cached.txt") eq $cached, "Read back data written through block cache");
+ok(-s "mnt/cached.bin" == 65536 && $cached_fsck == 0,
+   "Preallocated file through block cache survives remount and fsck");
+unmount();
+
+# An image several times the smallest cache, so blocks get evicted,
+# written back dirty and held outside the slots
+system("rm -f cache.nufs");
+mount("-o size=8,cache=1", "cache.nufs");
+my @evicted = map { "evicted $_ " x 200000 . "end" } (1..2);
+write_text("big$_.txt", $evicted[$_ - 1]) for (1..2);
+write_text("big1.txt", $evicted[1]);
+unmount();
+system("./fsck.nufs cache.nufs >> test.log");
+my $evicted_fsck = $?;
+mount("-o size=8,cache=1", "cache.nufs");
+ok(read_text("big1.txt") eq $evicted[1] && read_text("big2.txt") eq $evicted[1]
+   && $evicted_fsck == 0, "Files larger than the block cache survive remount and fsck");
+unmount();
+system("rm -f cache.nufs");
+
+say "#           == Striping Tests ==";
+
+system("rm -f stripe0.nufs stripe1.nufs");
+mount("-o stripe=stripe1.nufs,stripe_unit=16", "stripe0.nufs");
+my $striped = "spread over two files " x 4000;
+write_text("striped.txt", $striped);
+unmount();
+mount("-o stripe=stripe1.nufs,stripe_unit=16", "stripe0.nufs");
+ok(read_text("striped.txt") eq $striped && (stat("stripe1.nufs"))[12] > 0,
+   "Read back file striped over two images");
+unmount();
+system("rm -f stripe0.nufs stripe1.nufs");
+
+say "#           == Scratch Tests ==";
+
+system("rm -f scratch.nufs kept.nufs");
+mount("-o scratch,hugepages", "scratch.nufs");
+write_text("temp.txt", "gone at unmount");
+ok(read_text("temp.txt") eq "gone at unmount" && !-e "scratch.nufs",
+   "Scratch filesystem works without an image file");
+unmount();
+
+mount("-o persist", "kept.nufs");
+write_text("kept.txt", "saved at unmount");
+unmount();
+mount("-o persist", "kept.nufs");
+ok(read_text("kept.txt") eq "saved at unmount", "Read back scratch data saved at unmount");
+unmount();
+system("rm -f scratch.nufs kept.nufs");
+
+say "#           == Changed Block Tests ==";
+
+system("rm -f backup.nufs full.delta incr.delta");
+system("./nufs-delta -g 0 data.nufs full.delta 2>> test.log && ./nufs-apply backup.nufs full.delta >> test.log");
+mount();
+write_text("later.txt", "after the backup");
+unmount();
+system("./nufs-delta data.nufs incr.delta 2>> test.log && ./nufs-apply backup.nufs incr.delta >> test.log");
+ok(-s "incr.delta" < -s "full.delta" / 4, "Incremental stream holds only changed blocks");
+mount("", "backup.nufs");
+ok(read_text("later.txt") eq "after the backup", "Backup image caught up by incremental stream");
+unmount();
+system("./nufs-delta data.nufs idle.delta 2>> test.log");
+ok(-s "idle.delta" < 1024, "Stream with nothing changed carries no block metadata");
+system("rm -f backup.nufs full.delta incr.delta idle.delta");
+
+say "#           == Defrag Tests ==";
+
+sub fragment {
+    my ($name) = @_;
+    for my $i (0..7) {
+        open my $fh, ">>", "mnt/$name";
+        print $fh chr(65 + $i) x 4096;
+        close $fh;
+        write_text("$name.gap$i", "in the way");
+    }
+    return join "", map { chr(65 + $_) x 4096 } (0..7);
+}
+
+mount();
+my $pieces = fragment("frag.bin");
+unmount();
+my $scattered = `./nufs-defrag -n data.nufs /frag.bin`;
+system("./nufs-defrag data.nufs /frag.bin >> test.log");
+my $gathered = `./nufs-defrag -n data.nufs /frag.bin`;
+say "# $scattered# $gathered";
+ok($scattered =~ /in ([2-9]) extents/ && $gathered =~ /8 blocks in 1 extents/,
+   "nufs-defrag makes a fragmented file contiguous");
+mount();
+ok(read_text("frag.bin") eq $pieces, "Read back defragmented file");
+unmount();
+
+mount("-o autodefrag");
+$pieces = fragment("auto.bin");
+ok(read_text("auto.bin") eq $pieces, "Read back file rewritten by autodefrag");
+unmount();
+$gathered = `./nufs-defrag -n data.nufs /auto.bin`;
+say "# $gathered";
+ok($gathered =~ /8 blocks in 1 extents/, "Autodefrag leaves closed files contiguous");
+
+mount();
+$pieces = fragment("shared.bin");
+system("./nufs-clone mnt/shared.bin mnt/twin.bin");
+unmount();
+my $kept = `./nufs-defrag data.nufs /shared.bin`;
+say "# $kept";
+ok($kept =~ /shares blocks with other files/, "nufs-defrag leaves blocks shared with a clone");
+
+say "#           == Fsck Tests ==";
+
+system("./fsck.nufs data.nufs >> test.log");
+ok($? == 0, "Fsck finds unmounted image consistent");
+
+# Flip a byte of a file's data block behind the filesystem's back
+system("rm -f corrupt.nufs");
+mount("", "corrupt.nufs");
+write_text("victim.txt", "corrupt me please " x 100);
+unmount();
+open my $img, "+<", "corrupt.nufs" or die;
+binmode $img;
+my $whole = do { local $/; <$img> };
+my $at = index($whole, "corrupt me please");
+seek $img, $at, 0;
+print $img "C";
+close $img;
+
+mount("", "corrupt.nufs");
+open my $victim, "<", "mnt/victim.txt" or die;
+my $got = sysread($victim, my $junk, 4096);
+my $eio = !defined($got) && $!{EIO};
+close $victim;
+unmount();
+ok($at > 0 && $eio, "Reading a corrupted block fails with EIO");
+
+system("./fsck.nufs corrupt.nufs >> test.log");
+ok($? != 0, "Fsck reports a corrupted block");
+system("rm -f corrupt.nufs");